@@ -9,20 +9,16 @@
 
 #define IGNORE(arg) ((void)arg)
 
-static enum DbiStatus aux_system(DbiRuntime dbi)
+static enum DbiStatus aux_system(DbiRuntime dbi, int argc, union DbiValue *args)
 {
-    int argc = dbi_get_argc(dbi);
-    assert(argc == 1);
-    struct DbiObject **argv = dbi_get_argv(dbi);
-    if (argv[0]->type != DBI_STR) {
-        dbi_runtime_error(dbi, "expected string argument for SYSTEM command");
-        return DBI_STATUS_ERROR;
-    }
-    system(argv[0]->bstr);
+    IGNORE(argc);
+    // Command writes to stdout itself
+    dbi_flush(dbi);
+    system(args[0].bstr);
     return DBI_STATUS_GOOD;
 }
 
-static void aux_big_print_obj(struct DbiObject *obj)
+static void aux_big_print_obj(DbiRuntime dbi, struct DbiObject *obj)
 {
     size_t len;
     char *strbuff;
@@ -37,7 +33,7 @@ static void aux_big_print_obj(struct DbiObject *obj)
     } else {
         assert(false && "Internal runtime error: unknown type in BIG statement");
     }
-    print_big(strbuff);
+    print_big(dbi, strbuff);
     free(strbuff);
 }
 
@@ -52,31 +48,39 @@ static enum DbiStatus aux_big(DbiRuntime dbi)
     struct DbiObject **argv = dbi_get_argv(dbi);
     for (int i = 0; i < argc; i++) {
         struct DbiObject *obj = argv[i];
-        aux_big_print_obj(obj);
-        fflush(stdout);
+        aux_big_print_obj(dbi, obj);
     }
     return DBI_STATUS_GOOD;
 }
 
-static enum DbiStatus aux_sleep(DbiRuntime dbi)
+static enum DbiStatus aux_sleep(DbiRuntime dbi, int argc, union DbiValue *args)
 {
-    int argc = dbi_get_argc(dbi);
-    assert(argc == 1);
-    struct DbiObject **argv = dbi_get_argv(dbi);
-    if (argv[0]->type != DBI_INT) {
-        dbi_runtime_error(dbi, "expected integer argument for SLEEP command");
-        return DBI_STATUS_ERROR;
-    }
-    sleep(argv[0]->bint);
+    IGNORE(argc);
+    return dbi_runtime_sleep(dbi, args[0].bint * 1000);
+}
+
+static enum DbiStatus aux_len(DbiRuntime dbi, int argc, union DbiValue *args, union DbiValue *result)
+{
+    IGNORE(dbi);
+    IGNORE(argc);
+    result->bint = strlen(args[0].bstr);
+    return DBI_STATUS_GOOD;
+}
+
+static enum DbiStatus aux_abs(DbiRuntime dbi, int argc, union DbiValue *args, union DbiValue *result)
+{
+    IGNORE(dbi);
+    IGNORE(argc);
+    result->bint = labs(args[0].bint);
     return DBI_STATUS_GOOD;
 }
 
-static void aux_print_obj(struct DbiObject *obj)
+static void aux_print_obj(DbiRuntime dbi, struct DbiObject *obj)
 {
     if (obj->type == DBI_INT) {
-        printf("%ld", obj->bint);
+        dbi_write_int(dbi, obj->bint);
     } else if (obj->type == DBI_STR) {
-        printf("%s", obj->bstr);
+        dbi_write(dbi, obj->bstr, strlen(obj->bstr));
     } else {
         assert(false && "Internal runtime error: unknown type in PRINT statement");
     }
@@ -92,10 +96,9 @@ static enum DbiStatus aux_print(DbiRuntime dbi)
     struct DbiObject **argv = dbi_get_argv(dbi);
     for (int i = 0; i < argc; i++) {
         struct DbiObject *obj = argv[i];
-        aux_print_obj(obj);
-        fflush(stdout);
+        aux_print_obj(dbi, obj);
     }
-    printf("\n");
+    dbi_write(dbi, "\n", 1);
     return DBI_STATUS_GOOD;
 }
 
@@ -103,27 +106,37 @@ static enum DbiStatus aux_beep(DbiRuntime dbi)
 {
     int argc = dbi_get_argc(dbi);
     assert(argc == 0);
-    printf("\a\n");
+    dbi_write(dbi, "\a\n", 2);
     return DBI_STATUS_GOOD;
 }
 
 static enum DbiStatus aux_quote(DbiRuntime dbi)
 {
-    IGNORE(dbi);
-    printf( "\n\t\"It is practically impossible to teach good programming to students\n"
+    char *quote = "\n\t\"It is practically impossible to teach good programming to students\n"
             "\tthat have had a prior exposure to BASIC: as potential programmers\n"
             "\tthey are mentally mutilated beyond hope of regeneration.\"\n"
-            "\t― Edsger Dijkstra\n\n");
+            "\t― Edsger Dijkstra\n\n";
+    dbi_write(dbi, quote, strlen(quote));
+    return DBI_STATUS_GOOD;
+}
+
+static enum DbiStatus aux_flush(DbiRuntime dbi)
+{
+    dbi_flush(dbi);
     return DBI_STATUS_GOOD;
 }
 
 void aux_register_commands(DbiProgram prog)
 {
-    dbi_register_command_with_info(prog, "QUOTE",  aux_quote,  0,  "an inspirational quote",             "QUOTE");
-    dbi_register_command_with_info(prog, "BEEP",   aux_beep,   0,  "rings the bell",                     "BEEP");
-    dbi_register_command_with_info(prog, "SLEEP",  aux_sleep,  1,  "sleeps for number of seconds",       "SLEEP int");
-    dbi_register_command_with_info(prog, "SYSTEM", aux_system, 1,  "run terminal command",               "SYSTEM string");
-    dbi_register_command_with_info(prog, "PRINT",  aux_print,  -1, "print concatenated expression list", "PRINT expr-list");
-    dbi_register_command_with_info(prog, "BIG",    aux_big,    -1, "print embiggened text",              "BIG expr-list");
+    dbi_register_command_with_info(prog,           "QUOTE",  aux_quote,  0,   "an inspirational quote",             "QUOTE");
+    dbi_register_command_with_info(prog,           "BEEP",   aux_beep,   0,   "rings the bell",                     "BEEP");
+    dbi_register_typed_command_with_info(prog,     "SLEEP",  aux_sleep,  "I", "sleeps for number of seconds",       "SLEEP int");
+    dbi_register_typed_command_with_info(prog,     "SYSTEM", aux_system, "S", "run terminal command",               "SYSTEM string");
+    dbi_register_command_with_info(prog,           "FLUSH",  aux_flush,  0,   "write out buffered output",          "FLUSH");
+    // Only read their arguments while running, so they don't need copies
+    dbi_register_borrowing_command_with_info(prog, "PRINT",  aux_print,  -1,  "print concatenated expression list", "PRINT expr-list");
+    dbi_register_borrowing_command_with_info(prog, "BIG",    aux_big,    -1,  "print embiggened text",              "BIG expr-list");
+    dbi_register_function_with_info(prog,          "LEN",    aux_len,    "S", DBI_INT, "length of string",          "LEN(string)");
+    dbi_register_function_with_info(prog,          "ABS",    aux_abs,    "I", DBI_INT, "absolute value of number",  "ABS(int)");
 }
 
@@ -13,8 +13,13 @@ void print_cli_help(void)
     printf("Usage: dbi [options] \n"
             "Options:\n"
             "  -c file    compile file and print resulting bytecode\n"
-            "  -e file    execute file\n"
+            "  -e file    execute file (source or compiled image)\n"
+            "  -O file    optimize and execute file\n"
+            "  -o out file\n"
+            "             compile file and save resulting image to out\n"
             // "  -r file    execute file and start repl\n"
+            "Environment:\n"
+            "  DBI_CACHE_DIR  directory to cache compiled source files in\n"
           );
 }
 
@@ -26,6 +31,10 @@ int main(int argc, char *argv[])
 {
     DbiProgram prog = dbi_program_new();
     aux_register_commands(prog);
+    char *cache_dir = getenv("DBI_CACHE_DIR");
+    if (cache_dir) {
+        dbi_set_compile_cache(prog, cache_dir);
+    }
 
     int ret = EXIT_FAILURE;
     if (argc < 2) {
@@ -49,13 +58,14 @@ int main(int argc, char *argv[])
             } else {
                 dbi_print_compiled(prog);
             }
-        } else if (strcmp(argv[1], "-e") == 0) {
-            ret = status(dbi_compile_file(prog, argv[2]));
+        } else if (strcmp(argv[1], "-e") == 0 || strcmp(argv[1], "-O") == 0) {
+            ret = status(dbi_compile_file(prog, argv[2])
+                    && (strcmp(argv[1], "-O") != 0 || dbi_optimize(prog)));
             if (ret == EXIT_FAILURE) {
                 printf("%s", dbi_strerror());
             } else {
                 DbiRuntime dbi = dbi_runtime_new();
-                ret = status(dbi_run(dbi, prog));
+                ret = status(dbi_run(dbi, prog) == DBI_STATUS_FINISHED);
                 if (ret == EXIT_FAILURE) {
                     printf("%s", dbi_strerror());
                 }
@@ -66,6 +76,11 @@ int main(int argc, char *argv[])
         } else {
             printf(bad_input, argv[1]);
         }
+    } else if (argc == 4 && strcmp(argv[1], "-o") == 0) {
+        ret = status(dbi_compile_file(prog, argv[3]) && dbi_save_image(prog, argv[2]));
+        if (ret == EXIT_FAILURE) {
+            printf("%s", dbi_strerror());
+        }
     } else {
         printf("Error: invalid arguments\n");
     }
@@ -8,34 +8,74 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "dbi.h"
 
 #define IGNORE(arg) ((void)arg)
 
 // This is the only mutable global variable. It is just used for making error messages nice.
-static long global_lineno = 0;
+// It is thread local, so that programs can be compiled on several threads at once.
+static _Thread_local long global_lineno = 0;
 
 // I lied, this is also a mutable global
-static char global_err_msg[DBI_MAX_ERROR] = {0};
+static _Thread_local char global_err_msg[DBI_MAX_ERROR] = {0};
+
+// Worker threads compiling in parallel collect errors here instead, so they can be merged in
+// order afterwards. Collection stops once there are more errors than fit into a message anyway.
+struct ErrorLog {
+    char text[2 * DBI_MAX_ERROR];
+    size_t len;
+};
+
+static _Thread_local struct ErrorLog *global_error_log = NULL;
+
+// Appends to error message, cutting it short once it is full
+static void append_error(const char *msg)
+{
+    size_t len = strlen(global_err_msg);
+    size_t msg_len = strlen(msg);
+    if (len + msg_len < DBI_MAX_ERROR) {
+        memcpy(global_err_msg + len, msg, msg_len + 1);
+    } else {
+        char *too_many_errors = "...\n(too many errors to display)\n";
+        strcpy(global_err_msg + DBI_MAX_ERROR - strlen(too_many_errors) - 1, too_many_errors);
+    }
+}
 
 static void compile_error(const char *fmt, ...)
 {
-    int len = strlen(global_err_msg);
+    char msg[DBI_MAX_ERROR];
+    int len = 0;
     if (global_lineno <= 0) {
-        len += snprintf(global_err_msg + len, DBI_MAX_ERROR - len, "Error: ");
+        len = snprintf(msg, DBI_MAX_ERROR, "Error: ");
     } else {
-        len += snprintf(global_err_msg + len, DBI_MAX_ERROR - len, "Error at line %ld: ",
-                global_lineno);
+        len = snprintf(msg, DBI_MAX_ERROR, "Error at line %ld: ", global_lineno);
     }
     va_list args;
     va_start(args, fmt);
-    len += vsnprintf(global_err_msg + len, DBI_MAX_ERROR - len, fmt, args);
+    vsnprintf(msg + len, DBI_MAX_ERROR - len - 1, fmt, args);
     va_end(args);
-    snprintf(global_err_msg + len, DBI_MAX_ERROR - len, "\n");
-    if (DBI_MAX_ERROR - len <= 0) {
-        char *too_many_errors = "...\n(too many errors to display)\n";
-        len = DBI_MAX_ERROR - strlen(too_many_errors) - 1;
-        snprintf(global_err_msg + len, DBI_MAX_ERROR - len, too_many_errors);
+    strcat(msg, "\n");
+    struct ErrorLog *log = global_error_log;
+    if (!log) {
+        append_error(msg);
+    } else if (log->len < DBI_MAX_ERROR) {
+        size_t msg_len = strlen(msg);
+        memcpy(log->text + log->len, msg, msg_len + 1);
+        log->len += msg_len;
     }
 #if DBI_DEBUG
     printf("%s", global_err_msg);
@@ -61,7 +101,8 @@ enum Command {
     UNDEFINED, IF,      GOTO,
     INPUT,     LET,     GOSUB,   RETURN,
     CLEAR,     LIST,    RUN,     REM,   
-    LOAD,      SAVE,    LISTB,   END
+    LOAD,      SAVE,    LISTB,   FOR,
+    NEXT,      DIM,     END
 };
 
 // Note: Other parts of the code assume that END is the largest value in this list.
@@ -81,14 +122,17 @@ struct CommandMapping command_map[] = {
     { "LET",    LET,    "set variable to expression",                         "LET var = expr" },
     { "GOSUB",  GOSUB,  "jump to given line number",                          "GOSUB expr" },
     { "RETURN", RETURN, "return to the line following the last GOSUB called", "RETURN" },
+    { "FOR",    FOR,    "count var from one expr to another, looping at NEXT",  "FOR var = expr TO expr [STEP expr]" },
+    { "NEXT",   NEXT,   "step innermost (or var's) FOR loop",                 "NEXT [var]" },
+    { "DIM",    DIM,    "create integer array indexed from 0 to expr",        "DIM var(expr) [, var(expr) ...]" },
     { "RUN",    RUN,    "execute loaded code",                                "RUN" },
     { "END",    END,    "end execution of program",                           "END" },
     { "REM",    REM,    "adds a comment",                                     "REM comment" },
+    { "INPUT",  INPUT,  "get user input(s) and assign to variable(s)",        "INPUT var-list" },
 #if !DBI_DISABLE_IO
     { "CLEAR",  CLEAR,  "delete loaded code",                                 "CLEAR" },
     { "LIST",   LIST,   "print out loaded code",                              "LIST" },
     { "LISTB",  LISTB,  "print out loaded bytecode",                          "LISTB" },
-    { "INPUT",  INPUT,  "get user input(s) and assign to variable(s)",        "INPUT var-list" },
     { "LOAD",   LOAD,   "load code from file",                                "LOAD expr" },
     { "SAVE",   SAVE,   "save code to file",                                  "SAVE expr" },
 #endif
@@ -160,10 +204,15 @@ enum Opcode {
     OP_PUSH,
     OP_JMP, // Jumps to line
     OP_JNZ, // Technnically this jumps to an opcode within a line, not an actual line
-    OP_CALL,
+    OP_CALL, // Pops line, saves position to RETURN to and jumps to line
     OP_INPUT,
     OP_LET,
     OP_RETURN,
+    OP_FOR, // Starts loop over variable, popping step and limit
+    OP_NEXT, // Steps loop variable, then jumps back to just after FOR if it is still in range
+    OP_DIM, // Allocates array, popping its highest index
+    OP_AGET, // Pops index, pushes array element
+    OP_ASET, // Pops value and index, sets array element
 
     // Meta programming operations
     OP_CLEAR,
@@ -174,8 +223,11 @@ enum Opcode {
     OP_LOAD,
     OP_SAVE,
     OP_FFI_CALL,
+    OP_FFI_TYPED_CALL, // Pops command, checks its arguments against its signature and calls it
+    OP_FFI_FUNC, // Pops function and its arguments (count is next byte), pushes its result
     OP_FFI_ARG,
     OP_FFI_MACRO_ARG,
+    OP_FFI_BORROW_ARG, // Pops argument for command that borrows its arguments, without copying
 
     // Comparison operators
     OP_LT,
@@ -193,6 +245,9 @@ enum Opcode {
     OP_MOD,
 };
 
+// Argument of OP_NEXT when NEXT is not given a variable, which steps the innermost loop
+#define NEXT_ANY_VAR DBI_MAX_VARS
+
 struct OperatorMap {
     enum Opcode op;
     char *str;
@@ -207,6 +262,11 @@ struct OperatorMap op_map[] = {
     { OP_INPUT,    "INPUT" },
     { OP_LET,      "LET" },
     { OP_RETURN,   "RETURN" },
+    { OP_FOR,      "FOR" },
+    { OP_NEXT,     "NEXT" },
+    { OP_DIM,      "DIM" },
+    { OP_AGET,     "AGET" },
+    { OP_ASET,     "ASET" },
     { OP_CLEAR,    "CLEAR" },
     { OP_LIST,     "LIST" },
     { OP_LISTB,    "LISTB" },
@@ -215,7 +275,11 @@ struct OperatorMap op_map[] = {
     { OP_LOAD,     "LOAD" },
     { OP_SAVE,     "SAVE" },
     { OP_FFI_CALL, "FFI_CALL" },
+    { OP_FFI_TYPED_CALL, "FFI_TYPED_CALL" },
+    { OP_FFI_FUNC, "FFI_FUNC" },
     { OP_FFI_ARG,  "FFI_ARG" },
+    { OP_FFI_MACRO_ARG,  "FFI_MACRO_ARG" },
+    { OP_FFI_BORROW_ARG, "FFI_BORROW_ARG" },
     { OP_LT,       "LT" },
     { OP_GT,       "GT" },
     { OP_EQ,       "EQ" },
@@ -241,6 +305,26 @@ static char *op_to_str(enum Opcode op)
     return NULL;
 }
 
+// Returns number of bytes used by instruction (opcode + arguments)
+static int op_length(uint8_t *code)
+{
+    switch (code[0]) {
+        case OP_PUSH:
+        case OP_LET:
+        case OP_FOR:
+        case OP_NEXT:
+        case OP_DIM:
+        case OP_AGET:
+        case OP_ASET:
+        case OP_FFI_FUNC:
+            return 2;
+        case OP_INPUT:
+            return 2 + code[1];
+        default:
+            return 1;
+    }
+}
+
 // *******************************************************************
 // ************************** Basic Objects **************************
 // *******************************************************************
@@ -288,6 +372,14 @@ static void bobj_copy(struct DbiObject *dest, struct DbiObject *src)
     }
 }
 
+static struct DbiObject *bobj_dup(struct DbiObject *obj)
+{
+    struct DbiObject *copy = malloc(sizeof(*copy));
+    copy->type = DBI_INT;
+    bobj_copy(copy, obj);
+    return copy;
+}
+
 static struct DbiObject *bvar_new(char c)
 {
     struct DbiObject *obj = malloc(sizeof(*obj));
@@ -380,23 +472,103 @@ static void bytecode_add(struct Bytecode *bytecode, uint8_t byte)
 // ************************* Basic Statement ************************* 
 // *******************************************************************
 
+// Source text that statements are compiled from in place. Sources are kept until no statement
+// points into them anymore.
+struct Source {
+    char *text; // Always followed by a NUL byte, so the last line ends like any other
+    size_t size;
+    bool mapped;
+    atomic_long refs; // Number of statements pointing into text
+    struct Source *next;
+};
+
 struct Statement {
     long lineno;
-    char *line;
+    char *line; // Not NUL-terminated if line points into a source
+    size_t line_len;
+    struct Source *source; // Source that line points into, or NULL if line is owned
+    uint64_t hash; // Hash of line, used to find lines that are unchanged when recompiling
     // list of DbiObjects used by statement
     struct Memory *memory;
     struct Bytecode *bytecode;
+    // If true, statement points into a loaded image and is freed along with the image
+    bool borrowed;
+    // If true, bytecode was rewritten by dbi_optimize using other lines, so it is only valid in
+    // the program it was optimized in
+    bool optimized;
+    // Range of bytecode inlined from a subroutine on another line, for reporting errors there
+    int inline_start;
+    int inline_end;
+    long inline_lineno;
+    atomic_int compile_state;
+    // Numbers of the first version that included the statement and of the version that replaced
+    // or deleted it, which tell which versions can still run it once it is retired
+    long added;
+    long retired;
 };
 
-static struct Statement *statement_new(long lineno, char *input, struct Memory *memory,
-        struct Bytecode *bytecode)
+// Lazily compiled statements have no memory or bytecode until they first run. Deleted
+// statements are never run: they only mark a line to remove when a program is updated.
+enum CompileState {
+    STATEMENT_COMPILED = 0,
+    STATEMENT_LAZY,
+    STATEMENT_COMPILING,
+    STATEMENT_DELETED,
+};
+
+#define LINE_HASH_PRIME UINT64_C(0x9e3779b97f4a7c15)
+
+// Reads a word at a time, since every compiled line is hashed
+static uint64_t line_hash(char *line, size_t len)
+{
+    uint64_t hash = len;
+    uint64_t word;
+    for (; len >= 8; line += 8, len -= 8) {
+        memcpy(&word, line, 8);
+        hash = (hash ^ word) * LINE_HASH_PRIME;
+        hash ^= hash >> 29;
+    }
+    word = 0;
+    memcpy(&word, line, len);
+    hash = (hash ^ word) * LINE_HASH_PRIME;
+    return hash ^ (hash >> 29);
+}
+
+// If source is set, line points into its text. Otherwise line is copied.
+// If memory and bytecode are NULL, the statement is compiled lazily.
+static struct Statement *statement_new(long lineno, char *line, size_t line_len,
+        struct Source *source, struct Memory *memory, struct Bytecode *bytecode)
 {
     struct Statement *stmt = malloc(sizeof(*stmt));
 
     // Line info
     stmt->lineno = lineno;
-    stmt->line = malloc(strlen(input) + 1);
-    strcpy(stmt->line, input);
+    stmt->borrowed = false;
+    stmt->optimized = false;
+    stmt->inline_start = 0;
+    stmt->inline_end = 0;
+    stmt->inline_lineno = 0;
+    stmt->added = 0;
+    stmt->retired = 0;
+    if (source) {
+        stmt->line = line;
+        source->refs++;
+    } else {
+        stmt->line = malloc(line_len + 1);
+        memcpy(stmt->line, line, line_len);
+        stmt->line[line_len] = '\0';
+    }
+    stmt->line_len = line_len;
+    stmt->source = source;
+    stmt->hash = line_hash(line, line_len);
+
+    if (!memory) {
+        stmt->memory = NULL;
+        stmt->bytecode = NULL;
+        atomic_init(&stmt->compile_state, STATEMENT_LAZY);
+        return stmt;
+    }
+    atomic_init(&stmt->compile_state, STATEMENT_COMPILED);
 
     // Memory
     stmt->memory = malloc(sizeof(*stmt->memory));
@@ -421,9 +593,30 @@ static struct Statement *statement_new(long lineno, char *input, struct Memory *
     return stmt;
 }
 
+// A line number on its own deletes that line
+static struct Statement *statement_deleted(long lineno, char *line, size_t line_len,
+        struct Source *source)
+{
+    struct Statement *stmt = statement_new(lineno, line, line_len, source, NULL, NULL);
+    atomic_init(&stmt->compile_state, STATEMENT_DELETED);
+    return stmt;
+}
+
+static bool statement_is_deleted(struct Statement *stmt)
+{
+    return atomic_load_explicit(&stmt->compile_state, memory_order_relaxed) == STATEMENT_DELETED;
+}
+
 static void statement_free(struct Statement *stmt)
 {
-    free(stmt->line);
+    if (stmt->borrowed) {
+        return;
+    }
+    if (stmt->source) {
+        stmt->source->refs--;
+    } else {
+        free(stmt->line);
+    }
     if (stmt->memory) {
         memory_clear(stmt->memory);
         free(stmt->memory->array);
@@ -452,7 +645,7 @@ static void program_list(struct Statement **program)
     for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
         struct Statement *stmt = program[i];
         if (stmt) {
-            printf("%s", stmt->line);
+            fwrite(stmt->line, 1, stmt->line_len, stdout);
         }
     }
 }
@@ -462,7 +655,8 @@ static void program_listb(struct Statement **program)
     bool first = true;
     for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
         struct Statement *stmt = program[i];
-        if (stmt) {
+        // Lazily compiled lines that have not run yet have no bytecode to list
+        if (stmt && stmt->bytecode) {
             if (first) {
                 first = false;
             } else {
@@ -472,7 +666,7 @@ static void program_listb(struct Statement **program)
                 printf("%04ld:%04d ", i, j);
                 uint8_t code = stmt->bytecode->array[j];
                 printf("%s", op_to_str(code));
-                if ((code == OP_PUSH || code == OP_LET || code == OP_INPUT) && j + 1 < stmt->bytecode->index) {
+                if (op_length(stmt->bytecode->array + j) > 1 && j + 1 < stmt->bytecode->index) {
                     uint8_t arg = stmt->bytecode->array[++j];
                     if (code == OP_PUSH) {
                         assert(arg < stmt->memory->index);
@@ -486,12 +680,18 @@ static void program_listb(struct Statement **program)
                         } else {
                             assert(false);
                         }
-                    } else if (code == OP_LET) {
-                        printf(" %c", arg + 'A');
-                    } else {
+                    } else if (code == OP_NEXT) {
+                        if (arg != NEXT_ANY_VAR) {
+                            printf(" %c", arg + 'A');
+                        }
+                    } else if (code == OP_INPUT) {
                         for (int k = 0; k < arg; k++) {
                             printf(" %c", stmt->bytecode->array[++j] + 'A');
                         }
+                    } else if (code == OP_FFI_FUNC) {
+                        printf(" %d", arg);
+                    } else {
+                        printf(" %c", arg + 'A');
                     }
                 }
                 printf("\n");
@@ -509,7 +709,7 @@ static long program_save(struct Statement **program, char *filename)
     for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
         struct Statement *stmt = program[i];
         if (stmt) {
-            fprintf(file, "%s", stmt->line);
+            fwrite(stmt->line, 1, stmt->line_len, file);
         }
     }
     fclose(file);
@@ -534,28 +734,408 @@ static struct Statement *statement_next(struct Statement **program, long lineno)
 struct ForeignCall {
     enum DbiStatus status;
     bool is_macro;
+    bool borrows_args;
     int argc;
     char *name;
     int extended_command_code; // Numeric value of command, as if it were in enum Command
     DbiForeignCall call;
+    // Only set for typed commands and functions
+    char *signature;
+    int signature_len; // Number of types in signature, excluding '*'
+    DbiTypedCall typed_call;
+    DbiAsyncCall async_call;
+    DbiFunction function;
+    enum DbiType result_type;
     char *docstring;
     char *example;
     struct ForeignCall *next;
 };
 
-struct Program {
+#define COMMAND_INDEX_INITIAL_SIZE 64
+
+struct CommandEntry {
+    char *name; // NULL if entry is empty
+    int len;
+    int command; // Value of enum Command, or extended command code
+    struct ForeignCall *fc; // NULL for builtin commands
+};
+
+/*
+ * Finds commands by name, and registered commands by code. Commands can only be registered before
+ * the program is compiled, so threads compiling the program can share the index without locking.
+ * Names are hashed into an open addressing table that is at most half full.
+ */
+struct CommandIndex {
+    struct CommandEntry *entries;
+    int size; // Power of two
+    int count;
+    struct ForeignCall **foreign_calls; // Indexed by extended command code - LAST_COMMAND - 1
+    int foreign_call_count;
+    int foreign_call_size;
+};
+
+static uint32_t command_hash(char *name, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Entry for name, or the empty entry it would be added at
+static struct CommandEntry *command_index_slot(struct CommandIndex *index, char *name, int len)
+{
+    uint32_t i = command_hash(name, len) & (index->size - 1);
+    while (index->entries[i].name != NULL && (index->entries[i].len != len
+                || strncmp(index->entries[i].name, name, len) != 0)) {
+        i = (i + 1) & (index->size - 1);
+    }
+    return &index->entries[i];
+}
+
+static struct CommandEntry *command_index_find(struct CommandIndex *index, char *name, int len)
+{
+    struct CommandEntry *entry = command_index_slot(index, name, len);
+    return entry->name ? entry : NULL;
+}
+
+// Returns false if there is already a command with the same name
+static bool command_index_add(struct CommandIndex *index, char *name, int command,
+        struct ForeignCall *fc)
+{
+    if (2 * (index->count + 1) > index->size) {
+        struct CommandEntry *old = index->entries;
+        int old_size = index->size;
+        index->size *= 2;
+        index->entries = calloc(index->size, sizeof(*index->entries));
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].name) {
+                *command_index_slot(index, old[i].name, old[i].len) = old[i];
+            }
+        }
+        free(old);
+    }
+    int len = strlen(name);
+    struct CommandEntry *entry = command_index_slot(index, name, len);
+    if (entry->name) {
+        return false;
+    }
+    *entry = (struct CommandEntry) { name, len, command, fc };
+    index->count++;
+    if (fc) {
+        if (index->foreign_call_count == index->foreign_call_size) {
+            index->foreign_call_size = index->foreign_call_size ? 2 * index->foreign_call_size : 16;
+            index->foreign_calls = realloc(index->foreign_calls,
+                    index->foreign_call_size * sizeof(*index->foreign_calls));
+        }
+        index->foreign_calls[index->foreign_call_count++] = fc;
+    }
+    return true;
+}
+
+static void command_index_init(struct CommandIndex *index)
+{
+    index->size = COMMAND_INDEX_INITIAL_SIZE;
+    index->entries = calloc(index->size, sizeof(*index->entries));
+    for (int i = 0; i < command_map_size; i++) {
+        if (command_map[i].command != UNDEFINED) {
+            command_index_add(index, command_map[i].str, command_map[i].command, NULL);
+        }
+    }
+}
+
+static void command_index_free(struct CommandIndex *index)
+{
+    free(index->entries);
+    free(index->foreign_calls);
+}
+
+/*
+ * Commands a program can use. Each program starts with its own registry, which commands are
+ * registered in. Once it is shared with dbi_registry_new it can't be changed, so programs on
+ * any thread can use it without locking.
+ */
+struct Registry {
+    struct ForeignCall *foreign_calls; // In order of registration
+    struct CommandIndex commands;
+    bool is_shared;
+    atomic_int refs; // Programs using the registry, plus the DbiRegistry handle if shared
+};
+
+struct Image;
+
+/*
+ * Programs are updated by publishing a new version of the statement table rather than by
+ * changing it in place, so that lines can be replaced while runtimes on other threads are running
+ * the program. A runtime pins the current version when it starts running and keeps it until it
+ * finishes, so it never sees half of an update or a freed statement.
+ *
+ * Readers never lock: pinning only increments counters. A pin could load the version pointer just
+ * before an update replaces it and increment the version's count just after, so updates wait for a
+ * grace period first (every pin that started before the update has finished pinning). Pins are
+ * counted in one of two slots picked by the epoch, which each update flips twice, so an update
+ * only waits for pins that started before it.
+ *
+ * Versions other than the current one are reclaimed as soon as no runtime has them pinned, in any
+ * order, so one runtime that stays suspended on an old version only keeps that version alive.
+ * Statements are shared between versions. A statement that an update replaces is retired, and
+ * freed once no version that is left includes it.
+ */
+struct Version {
     struct Statement **statements;
-    struct ForeignCall *foreign_calls;
-    DbiForeignCall *foreign_call_table;
+    atomic_long refs; // Number of runtimes that have this version pinned
+    _Atomic uint64_t hash; // Hash of program text used to check snapshots, or 0 if not calculated yet
+    long number; // Versions are numbered in the order they were published
+    struct Version *next; // Next newer version that has not been reclaimed
+};
+
+struct CompileStats {
+    long reused; // Lines that were the same as in the current version, so kept their statement
+    long compiled;
+};
+
+struct Program {
+    _Atomic(struct Version *) version; // Current version
+    struct Version *oldest; // Oldest version that has not been reclaimed yet
+    struct Statement **retired; // Statements replaced by an update that may still be running
+    long retired_count;
+    long retired_size;
+    pthread_mutex_t update_lock; // Only taken by updates
+    atomic_uint epoch;
+    atomic_long pins[2];
+    struct Image *images; // Compiled images that statements may point into
+    struct Source *sources; // Source files that statements may point into
+    struct Registry *registry;
     bool has_compiled;
+    char *cache_dir; // Directory compiled files are cached in, or NULL if caching is disabled
+    char *line_buf; // Returned by dbi_get_line
+    bool lazy_compile;
+    struct CompileStats compile_stats; // Lines reused and compiled by the last compile
+    atomic_long cache_hits;
+    atomic_long cache_misses;
 };
 
-DbiProgram dbi_program_new(void)
+static struct Version *version_new(struct Statement **statements)
+{
+    struct Version *version = calloc(1, sizeof(*version));
+    version->statements = calloc(DBI_MAX_PROG_SIZE, sizeof(*version->statements));
+    if (statements) {
+        memcpy(version->statements, statements, DBI_MAX_PROG_SIZE * sizeof(*statements));
+    }
+    atomic_init(&version->refs, 0);
+    atomic_init(&version->hash, 0);
+    return version;
+}
+
+static void version_free(struct Version *version)
+{
+    free(version->statements);
+    free(version);
+}
+
+static struct Program *program_new(struct Registry *registry)
 {
     struct Program *program = malloc(sizeof(*program));
     memset(program, 0, sizeof(*program));
-    program->statements = calloc(DBI_MAX_PROG_SIZE, sizeof(*program->statements));
-    return (DbiProgram) program;
+    program->oldest = version_new(NULL);
+    atomic_init(&program->version, program->oldest);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&program->update_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    atomic_init(&program->epoch, 0);
+    atomic_init(&program->pins[0], 0);
+    atomic_init(&program->pins[1], 0);
+    program->registry = registry;
+    return program;
+}
+
+DbiProgram dbi_program_new(void)
+{
+    struct Registry *registry = calloc(1, sizeof(*registry));
+    command_index_init(&registry->commands);
+    atomic_init(&registry->refs, 1);
+    return (DbiProgram) program_new(registry);
+}
+
+DbiProgram dbi_program_new_with_registry(DbiRegistry reg)
+{
+    assert(reg != 0);
+    struct Registry *registry = (struct Registry *) reg;
+    atomic_fetch_add(&registry->refs, 1);
+    return (DbiProgram) program_new(registry);
+}
+
+// Pinned versions (and every statement in them) stay valid until unpinned
+static struct Version *version_pin(struct Program *program)
+{
+    unsigned slot = atomic_load(&program->epoch) & 1;
+    atomic_fetch_add(&program->pins[slot], 1);
+    struct Version *version = atomic_load(&program->version);
+    atomic_fetch_add(&version->refs, 1);
+    atomic_fetch_sub(&program->pins[slot], 1);
+    return version;
+}
+
+// Waits until every pin that may have loaded a replaced version has counted itself in its refs
+static void program_synchronize(struct Program *program)
+{
+    for (int i = 0; i < 2; i++) {
+        unsigned slot = atomic_fetch_add(&program->epoch, 1) & 1;
+        while (atomic_load(&program->pins[slot]) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+// Must be called with the update lock held
+static void program_reclaim(struct Program *program)
+{
+    struct Version *current = atomic_load(&program->version);
+    struct Version **link = &program->oldest;
+    while (*link != current) {
+        struct Version *version = *link;
+        if (atomic_load(&version->refs) == 0) {
+            *link = version->next;
+            version_free(version);
+        } else {
+            link = &version->next;
+        }
+    }
+
+    long kept = 0;
+    for (long i = 0; i < program->retired_count; i++) {
+        struct Statement *stmt = program->retired[i];
+        bool used = false;
+        for (struct Version *version = program->oldest; version != current && !used;
+                version = version->next) {
+            used = version->number >= stmt->added && version->number < stmt->retired;
+        }
+        if (used) {
+            program->retired[kept++] = stmt;
+        } else {
+            statement_free(stmt);
+        }
+    }
+    program->retired_count = kept;
+}
+
+// The last runtime to leave an old version reclaims it. If an update holds the lock, it is left
+// for the next update or unpin instead of waiting for the update to finish.
+static void version_unpin(struct Program *program, struct Version *version)
+{
+    if (atomic_fetch_sub(&version->refs, 1) == 1 && version != atomic_load(&program->version)
+            && pthread_mutex_trylock(&program->update_lock) == 0) {
+        program_reclaim(program);
+        pthread_mutex_unlock(&program->update_lock);
+    }
+}
+
+// Adds statement, replacing any existing line with the same number. Only used on statement
+// tables that no runtime can see, which may also hold statements reused from the shared table.
+static void statements_insert(struct Statement **statements, struct Statement *stmt,
+        struct Statement **shared)
+{
+    struct Statement *replaced = statements[stmt->lineno];
+    if (replaced && !(shared && replaced == shared[stmt->lineno])) {
+        statement_free(replaced);
+    }
+    statements[stmt->lineno] = stmt;
+}
+
+// Frees a statement table that was never published
+static void statements_free(struct Statement **statements, struct Statement **shared)
+{
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        if (statements[i] && !(shared && statements[i] == shared[i])) {
+            statement_free(statements[i]);
+        }
+    }
+    free(statements);
+}
+
+/*
+ * Publishes a new version of the program with stmts (which may contain NULLs) added, or with every
+ * line removed first if clear is set. Deleted statements remove their line, and statements that
+ * are already in the current version at the same line are kept as they are. Runtimes that are
+ * already running keep the version they started with.
+ *
+ * Optimized lines were rewritten using other lines, so once any line is changed by something other
+ * than the optimizer, the optimized lines that are kept go back to being compiled from their text.
+ *
+ * The update lock is recursive, so that it can be held across compiling and publishing.
+ */
+static void program_publish(struct Program *program, struct Statement **stmts, long count,
+        bool clear, bool optimizing)
+{
+    if (count == 0 && !clear) {
+        return;
+    }
+    pthread_mutex_lock(&program->update_lock);
+    struct Version *old = atomic_load(&program->version);
+    struct Version *version = version_new(clear ? NULL : old->statements);
+    bool changed = false;
+    for (long i = 0; i < count; i++) {
+        struct Statement *stmt = stmts[i];
+        if (!stmt) {
+            continue;
+        }
+        struct Statement *replaced = version->statements[stmt->lineno];
+        if (replaced == stmt) {
+            continue;
+        } else if (replaced && replaced != old->statements[stmt->lineno]) {
+            // Added earlier in this update, so no runtime has seen it
+            statement_free(replaced);
+        }
+        changed = true;
+        if (statement_is_deleted(stmt)) {
+            version->statements[stmt->lineno] = NULL;
+            statement_free(stmt);
+        } else {
+            version->statements[stmt->lineno] = stmt;
+        }
+    }
+    for (long i = 0; changed && !optimizing && !clear && i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = version->statements[i];
+        if (stmt && stmt->optimized && stmt == old->statements[i]) {
+            version->statements[i] = statement_new(stmt->lineno, stmt->line, stmt->line_len,
+                    stmt->source, NULL, NULL);
+        }
+    }
+
+    // Lines that were replaced or removed are retired
+    version->number = old->number + 1;
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        if (old->statements[i] == version->statements[i]) {
+            continue;
+        }
+        if (version->statements[i]) {
+            version->statements[i]->added = version->number;
+        }
+        if (old->statements[i]) {
+            if (program->retired_count == program->retired_size) {
+                program->retired_size = program->retired_size * 2 + 16;
+                program->retired = realloc(program->retired,
+                        program->retired_size * sizeof(*program->retired));
+            }
+            old->statements[i]->retired = version->number;
+            program->retired[program->retired_count++] = old->statements[i];
+        }
+    }
+
+    old->next = version;
+    atomic_store(&program->version, version);
+    program_synchronize(program);
+    program_reclaim(program);
+    pthread_mutex_unlock(&program->update_lock);
+}
+
+static void program_update(struct Program *program, struct Statement **stmts, long count,
+        bool clear)
+{
+    program_publish(program, stmts, count, clear, false);
 }
 
 void foreign_calls_free(struct ForeignCall *fc)
@@ -567,23 +1147,69 @@ void foreign_calls_free(struct ForeignCall *fc)
     }
 }
 
+static void images_free(struct Image *image);
+static void sources_free(struct Source *source);
+
+static void registry_release(struct Registry *registry)
+{
+    if (atomic_fetch_sub(&registry->refs, 1) == 1) {
+        foreign_calls_free(registry->foreign_calls);
+        command_index_free(&registry->commands);
+        free(registry);
+    }
+}
+
+DbiRegistry dbi_registry_new(DbiProgram prog)
+{
+    assert(prog != 0);
+    struct Registry *registry = ((struct Program *) prog)->registry;
+    registry->is_shared = true;
+    atomic_fetch_add(&registry->refs, 1);
+    return (DbiRegistry) registry;
+}
+
+void dbi_registry_free(DbiRegistry reg)
+{
+    assert(reg != 0);
+    registry_release((struct Registry *) reg);
+}
+
 void dbi_program_free(DbiProgram prog)
 {
     assert(prog != 0);
     struct Program *program = (struct Program *) prog;
-    foreign_calls_free(program->foreign_calls);
-    program_clear(program->statements);
-    if (program->foreign_call_table) {
-        free(program->foreign_call_table);
+    registry_release(program->registry);
+    // Any runtime still running the program must have been freed already
+    struct Version *version = program->oldest;
+    while (version->next != NULL) {
+        struct Version *next = version->next;
+        version_free(version);
+        version = next;
     }
-    free(program->statements);
+    program_clear(version->statements);
+    version_free(version);
+    for (long i = 0; i < program->retired_count; i++) {
+        statement_free(program->retired[i]);
+    }
+    free(program->retired);
+    pthread_mutex_destroy(&program->update_lock);
+    images_free(program->images);
+    sources_free(program->sources);
+    free(program->cache_dir);
+    free(program->line_buf);
     free(program);
 }
 
+// Lines end at a newline as well as a NUL, so that source files can be parsed in place
+static bool prefix_line_end(char c)
+{
+    return c == '\0' || c == '\n';
+}
+
 static void ignore_whitespace(char **input_ptr)
 {
     char *input = *input_ptr;
-    while (isspace(*input)) input++;
+    while (isspace(*input) && *input != '\n') input++;
     *input_ptr = input;
 }
 
@@ -611,7 +1237,7 @@ static bool prefix_expr(char c)
 
 static bool prefix_stmt_end(char c)
 {
-    return c == '\0' || c == ':';
+    return prefix_line_end(c) || c == ':';
 }
 
 static bool prefix_op(char c)
@@ -648,7 +1274,7 @@ static long parse_lineno(char *input, long *lineno)
 }
 
 // Returns number of chars consumed
-static int parse_command_name(char *input, struct ForeignCall *foreign_calls, 
+static int parse_command_name(char *input, struct CommandIndex *commands, 
         enum Command *command_ptr)
 {
     char command[DBI_MAX_COMMAND_NAME] = {0};
@@ -657,21 +1283,10 @@ static int parse_command_name(char *input, struct ForeignCall *foreign_calls,
         command[i] = toupper(input[i]);
         i++;
     }
-    for (int j = 0; j < command_map_size; j++) {
-        int len = strlen(command_map[j].str);
-        if (i == len && command_map[j].command != UNDEFINED
-                && strncmp(command, command_map[j].str, len) == 0) {
-            *command_ptr = command_map[j].command;
-            return i;
-        }
-    }
-    for (int j = 0; foreign_calls != NULL; j++) {
-        int len = strlen(foreign_calls->name);
-        if (i == len && strncmp(command, foreign_calls->name, len) == 0) {
-            *command_ptr = foreign_calls->extended_command_code;
-            return i;
-        }
-        foreign_calls = foreign_calls->next;
+    struct CommandEntry *entry = command_index_find(commands, command, i);
+    if (entry) {
+        *command_ptr = entry->command;
+        return i;
     }
     compile_error("unknown command");
     return 0;
@@ -683,7 +1298,7 @@ static int compile_string(char *input, struct Memory *memory, struct Bytecode *b
     input++; // discard opening quote
     char *str_start = input;
     while (*input != '"') {
-        if (*input == '\0') {
+        if (prefix_line_end(*input)) {
             compile_error("unexpected end of string");
             return 0;
         }
@@ -799,7 +1414,14 @@ static void print_stack(char stack[DBI_MAX_STACK], int stack_offset)
 }
 #endif
 
-static int compile_expr(char *input, struct Memory *memory, struct Bytecode *bytecode)
+static int compile_subscript(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode);
+static int compile_function(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode);
+
+// If nested, the expression is an array index and ends at the ')' closing it
+static int compile_nested_expr(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode, bool nested)
 {
     char *init_input = input;
     int chars_parsed = 0;
@@ -809,14 +1431,15 @@ static int compile_expr(char *input, struct Memory *memory, struct Bytecode *byt
     int op_stack_offset = 0;
     int mode_op = 0;
     char op = 0;
-    while (*input != '\0') {
+    // An operator at the end of the line still needs an operand
+    while (!mode_op || !prefix_line_end(*input)) {
         ignore_whitespace(&input);
 
         if (mode_op) {
             if (*input == ')') {
                 while (*input == ')') {
                     op = peek();
-                    if (op == 0) {
+                    if (op == 0 && !nested) {
                         compile_error("closing parenthesis does not match any opening parenthesis");
                         return 0;
                     }
@@ -825,7 +1448,10 @@ static int compile_expr(char *input, struct Memory *memory, struct Bytecode *byt
                         pop();
                         op = peek();
                     }
-                    if (op != '(') {
+                    if (op == 0 && nested) {
+                        // Closes array index
+                        break;
+                    } else if (op != '(') {
                         compile_error("opening parenthesis does not match any closing parenthesis");
                         return 0;
                     }
@@ -887,6 +1513,21 @@ static int compile_expr(char *input, struct Memory *memory, struct Bytecode *byt
                     return 0;
                 }
                 input += chars_parsed;
+            } else if (prefix_var(*input) && prefix_var(input[1])) {
+                chars_parsed = compile_function(input, commands, memory, bytecode);
+                if (!chars_parsed) {
+                    return 0;
+                }
+                input += chars_parsed;
+            } else if (prefix_var(*input) && input[1] == '(') {
+                uint8_t var = get_var(*input);
+                chars_parsed = compile_subscript(input + 1, commands, memory, bytecode);
+                if (!chars_parsed) {
+                    return 0;
+                }
+                input += chars_parsed + 1;
+                bytecode_add(bytecode, OP_AGET);
+                bytecode_add(bytecode, var);
             } else if (prefix_var(*input)) {
                 chars_parsed = compile_var(input, memory, bytecode);
                 if (!chars_parsed) {
@@ -927,60 +1568,193 @@ static int compile_expr(char *input, struct Memory *memory, struct Bytecode *byt
 #undef pop
 #undef peek
 
-// Returns number of chars parsed
-static int compile_print_like(char *input, struct Memory *memory, struct Bytecode *bytecode,
-        enum Opcode op, int num_args)
+static int compile_expr(char *input, struct CommandIndex *commands, struct Memory *memory,
+        struct Bytecode *bytecode)
 {
-    char *init_input = input;
-    ignore_whitespace(&input);
-    int arg_count = 0;
-    do {
-        int char_count = 0;
-
-        ignore_whitespace(&input);
-        if (prefix_expr(*input)) {
-            char_count = compile_expr(input, memory, bytecode);
-        } else if (prefix_stmt_end(*input)) {
-            compile_error("unexpected end of statement");
-            return 0;
-        } else {
-            compile_error("invalid input: %c", *input);
-            return 0;
-        }
+    return compile_nested_expr(input, commands, memory, bytecode, false);
+}
 
-        if (!char_count) {
-            return 0;
-        }
-        bytecode_add(bytecode, op);
-        input += char_count;
+// Compiles "(expr)" following an array name, which leaves the index on the stack
+static int compile_subscript(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode)
+{
+    char *init_input = input;
+    if (*input != '(') {
+        compile_error("expected '(' after array name");
+        return 0;
+    }
+    input++;
 
-        ignore_whitespace(&input);
-        arg_count++;
-        if (*input == ',') {
-            input++;
-        } else {
-            break;
-        }
-    } while (true);
-    if (num_args != -1 && arg_count != num_args) {
-        compile_error("expected %d argument(s) but got %d", num_args, arg_count);
+    ignore_whitespace(&input);
+    int chars_parsed = compile_nested_expr(input, commands, memory, bytecode, true);
+    if (!chars_parsed) {
         return 0;
     }
+    input += chars_parsed;
 
+    ignore_whitespace(&input);
+    if (*input != ')') {
+        compile_error("expected ')' after array index");
+        return 0;
+    }
+    input++;
     return input - init_input;
 }
 
-static int parse_relop(char *input, enum Opcode *op)
+// Type of argument i of typed command
+static char signature_type(struct ForeignCall *fc, int i)
 {
-    if (*input == '<') {
-        input++;
-        if (*input == '>') {
-            *op = OP_NEQ;
-            return 2;
-        } else if (*input == '=') {
-            *op = OP_LEQ;
-            return 2;
-        }
+    return fc->signature[i < fc->signature_len ? i : fc->signature_len - 1];
+}
+
+// Checks argument against signature of typed command, if it is a literal (the only instruction
+// compiled for it since start)
+static bool check_literal_arg(struct ForeignCall *fc, int i, struct Memory *memory,
+        struct Bytecode *bytecode, int start)
+{
+    if (bytecode->index - start != 2 || bytecode->array[start] != OP_PUSH) {
+        return true;
+    }
+    struct DbiObject *obj = memory->array[bytecode->array[start + 1]];
+    char type = signature_type(fc, i);
+    if ((obj->type == DBI_INT && type != 'I') || (obj->type == DBI_STR && type != 'S')) {
+        compile_error("argument %d of %s must be %s", i + 1, fc->name,
+                type == 'I' ? "an integer" : "a string");
+        return false;
+    }
+    return true;
+}
+
+// Compiles "NAME(expr, ...)", which calls a function and leaves its result on the stack
+static int compile_function(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode)
+{
+    char *init_input = input;
+    char name[DBI_MAX_COMMAND_NAME] = {0};
+    int len = 0;
+    while (prefix_var(input[len])) {
+        if (len + 1 >= DBI_MAX_COMMAND_NAME) {
+            compile_error("unknown function");
+            return 0;
+        }
+        name[len] = toupper(input[len]);
+        len++;
+    }
+    struct CommandEntry *entry = commands ? command_index_find(commands, name, len) : NULL;
+    struct ForeignCall *fc = entry ? entry->fc : NULL;
+    if (fc == NULL || !fc->function) {
+        compile_error("unknown function %s", name);
+        return 0;
+    }
+    input += len;
+    ignore_whitespace(&input);
+    if (*input != '(') {
+        compile_error("expected '(' after function name");
+        return 0;
+    }
+    input++;
+    ignore_whitespace(&input);
+
+    int arg_count = 0;
+    while (*input != ')') {
+        int start = bytecode->index;
+        int chars_parsed = compile_nested_expr(input, commands, memory, bytecode, true);
+        if (!chars_parsed || !check_literal_arg(fc, arg_count, memory, bytecode, start)) {
+            return 0;
+        }
+        input += chars_parsed;
+        arg_count++;
+        ignore_whitespace(&input);
+        if (*input == ',') {
+            input++;
+            ignore_whitespace(&input);
+        } else if (*input != ')') {
+            compile_error("expected ',' or ')' after argument");
+            return 0;
+        }
+    }
+    input++;
+    if (arg_count < fc->signature_len || (fc->argc != -1 && arg_count != fc->argc)) {
+        compile_error("%s expects %s%d argument(s) but got %d", fc->name,
+                fc->argc == -1 ? "at least " : "", fc->signature_len, arg_count);
+        return 0;
+    }
+
+    int ffi_index = fc->extended_command_code - LAST_COMMAND - 1;
+    int mem_loc = memory_add_int(memory, ffi_index);
+    if (mem_loc == -1) {
+        return 0;
+    }
+    bytecode_add(bytecode, OP_PUSH);
+    bytecode_add(bytecode, mem_loc);
+    bytecode_add(bytecode, OP_FFI_FUNC);
+    bytecode_add(bytecode, arg_count);
+    return input - init_input;
+}
+
+// Returns number of chars parsed. Literal arguments of typed command (fc is NULL otherwise) are
+// checked against its signature.
+static int compile_print_like(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode, enum Opcode op, int num_args,
+        struct ForeignCall *fc)
+{
+    char *init_input = input;
+    ignore_whitespace(&input);
+    int arg_count = 0;
+    do {
+        int char_count = 0;
+
+        ignore_whitespace(&input);
+        int start = bytecode->index;
+        if (prefix_expr(*input)) {
+            char_count = compile_expr(input, commands, memory, bytecode);
+        } else if (prefix_stmt_end(*input)) {
+            compile_error("unexpected end of statement");
+            return 0;
+        } else {
+            compile_error("invalid input: %c", *input);
+            return 0;
+        }
+
+        if (!char_count) {
+            return 0;
+        }
+        if (fc && !check_literal_arg(fc, arg_count, memory, bytecode, start)) {
+            return 0;
+        }
+        bytecode_add(bytecode, op);
+        input += char_count;
+
+        ignore_whitespace(&input);
+        arg_count++;
+        if (*input == ',') {
+            input++;
+        } else {
+            break;
+        }
+    } while (true);
+    if (num_args != -1 && arg_count != num_args) {
+        compile_error("expected %d argument(s) but got %d", num_args, arg_count);
+        return 0;
+    } else if (fc && arg_count < fc->signature_len) {
+        compile_error("expected at least %d argument(s) but got %d", fc->signature_len, arg_count);
+        return 0;
+    }
+
+    return input - init_input;
+}
+
+static int parse_relop(char *input, enum Opcode *op)
+{
+    if (*input == '<') {
+        input++;
+        if (*input == '>') {
+            *op = OP_NEQ;
+            return 2;
+        } else if (*input == '=') {
+            *op = OP_LEQ;
+            return 2;
+        }
         *op = OP_LT;
         return 1;
     } else if (*input == '>') {
@@ -1003,18 +1777,18 @@ static int parse_relop(char *input, enum Opcode *op)
     return 0;
 }
 
-static int compile_statement(char *input, struct ForeignCall *foreign_calls,
+static int compile_statement(char *input, struct CommandIndex *commands,
         struct Memory *memory, struct Bytecode *bytecode,
         long lineno, enum Command *command_ptr);
 
-static int compile_if(char *input, struct ForeignCall *foreign_calls, 
+static int compile_if(char *input, struct CommandIndex *commands, 
         struct Memory *memory, struct Bytecode *bytecode,
         long lineno, enum Command *command_ptr)
 {
     char *init_input = input;
 
     // Compile first expression
-    int char_count = compile_expr(input, memory, bytecode);
+    int char_count = compile_expr(input, commands, memory, bytecode);
     if (char_count == 0) {
         return 0;
     }
@@ -1031,7 +1805,7 @@ static int compile_if(char *input, struct ForeignCall *foreign_calls,
     ignore_whitespace(&input);
 
     // Compile second expression
-    char_count = compile_expr(input, memory, bytecode);
+    char_count = compile_expr(input, commands, memory, bytecode);
     if (char_count == 0) {
         return 0;
     }
@@ -1069,7 +1843,7 @@ static int compile_if(char *input, struct ForeignCall *foreign_calls,
     }
 
     // Parse statement
-    char_count = compile_statement(input, foreign_calls, memory, bytecode, lineno, command_ptr);
+    char_count = compile_statement(input, commands, memory, bytecode, lineno, command_ptr);
     if (!char_count) {
         return 0;
     }
@@ -1084,7 +1858,6 @@ static int compile_if(char *input, struct ForeignCall *foreign_calls,
     return input - init_input;
 }
 
-#if !DBI_DISABLE_IO
 static int compile_input(char *input, struct Bytecode *bytecode)
 {
     char *init_input = input;
@@ -1132,11 +1905,10 @@ static int compile_input(char *input, struct Bytecode *bytecode)
     }
     return input - init_input;
 }
-#endif
 
 // Generic method for compiling commands similar to LET
-static int compile_let_like(char *input, struct Memory *memory, struct Bytecode *bytecode,
-        char *command_name, enum Opcode op)
+static int compile_let_like(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode, char *command_name, enum Opcode op)
 {
     char *init_input = input;
     if (!prefix_var(*input)) {
@@ -1154,7 +1926,7 @@ static int compile_let_like(char *input, struct Memory *memory, struct Bytecode
     input++;
 
     ignore_whitespace(&input);
-    int chars_parsed = compile_expr(input, memory, bytecode);
+    int chars_parsed = compile_expr(input, commands, memory, bytecode);
     if (!chars_parsed) {
         return 0;
     }
@@ -1165,9 +1937,151 @@ static int compile_let_like(char *input, struct Memory *memory, struct Bytecode
     return input - init_input;
 }
 
-static int compile_let(char *input, struct Memory *memory, struct Bytecode *bytecode)
+// Sets array element, leaving the index and then the value on the stack for OP_ASET
+static int compile_array_let(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode)
+{
+    char *init_input = input;
+    uint8_t var = get_var(*input);
+    input++;
+
+    int chars_parsed = compile_subscript(input, commands, memory, bytecode);
+    if (!chars_parsed) {
+        return 0;
+    }
+    input += chars_parsed;
+
+    ignore_whitespace(&input);
+    if (*input != '=') {
+        compile_error("missing '=' in LET statement");
+        return 0;
+    }
+    input++;
+
+    ignore_whitespace(&input);
+    chars_parsed = compile_expr(input, commands, memory, bytecode);
+    if (!chars_parsed) {
+        return 0;
+    }
+    input += chars_parsed;
+
+    bytecode_add(bytecode, OP_ASET);
+    bytecode_add(bytecode, var);
+    return input - init_input;
+}
+
+static int compile_let(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode)
+{
+    if (prefix_var(*input) && input[1] == '(') {
+        return compile_array_let(input, commands, memory, bytecode);
+    }
+    return compile_let_like(input, commands, memory, bytecode, "LET", OP_LET);
+}
+
+static int compile_dim(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode)
+{
+    char *init_input = input;
+    while (true) {
+        if (!prefix_var(*input)) {
+            compile_error("expected array name");
+            return 0;
+        }
+        uint8_t var = get_var(*input);
+        input++;
+
+        int chars_parsed = compile_subscript(input, commands, memory, bytecode);
+        if (!chars_parsed) {
+            return 0;
+        }
+        input += chars_parsed;
+        bytecode_add(bytecode, OP_DIM);
+        bytecode_add(bytecode, var);
+
+        ignore_whitespace(&input);
+        if (*input != ',') {
+            break;
+        }
+        input++;
+        ignore_whitespace(&input);
+    }
+    return input - init_input;
+}
+
+// Returns number of chars in keyword if input starts with it (in any case), otherwise 0
+static int parse_keyword(char *input, char *keyword)
+{
+    int i = 0;
+    for (; keyword[i] != '\0'; i++) {
+        if (toupper(input[i]) != keyword[i]) {
+            return 0;
+        }
+    }
+    return i;
+}
+
+// FOR sets the variable like LET, then pushes the limit and step for OP_FOR. The loop body is
+// everything after OP_FOR, which may start on the same line.
+static int compile_for(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode)
+{
+    char *init_input = input;
+    int chars_parsed = compile_let_like(input, commands, memory, bytecode, "FOR", OP_LET);
+    if (!chars_parsed) {
+        return 0;
+    }
+    uint8_t var = get_var(*input);
+    input += chars_parsed;
+
+    ignore_whitespace(&input);
+    chars_parsed = parse_keyword(input, "TO");
+    if (!chars_parsed) {
+        compile_error("expected 'TO'");
+        return 0;
+    }
+    input += chars_parsed;
+
+    ignore_whitespace(&input);
+    chars_parsed = compile_expr(input, commands, memory, bytecode);
+    if (!chars_parsed) {
+        return 0;
+    }
+    input += chars_parsed;
+
+    ignore_whitespace(&input);
+    chars_parsed = parse_keyword(input, "STEP");
+    if (chars_parsed) {
+        input += chars_parsed;
+        ignore_whitespace(&input);
+        chars_parsed = compile_expr(input, commands, memory, bytecode);
+        if (!chars_parsed) {
+            return 0;
+        }
+        input += chars_parsed;
+    } else {
+        int mem_loc = memory_add_int(memory, 1);
+        if (mem_loc == -1) {
+            return 0;
+        }
+        bytecode_add(bytecode, OP_PUSH);
+        bytecode_add(bytecode, mem_loc);
+    }
+
+    bytecode_add(bytecode, OP_FOR);
+    bytecode_add(bytecode, var);
+    return input - init_input;
+}
+
+static int compile_next(char *input, struct Bytecode *bytecode)
 {
-    return compile_let_like(input, memory, bytecode, "LET", OP_LET);
+    uint8_t var = NEXT_ANY_VAR;
+    if (prefix_var(*input)) {
+        var = get_var(*input);
+    }
+    bytecode_add(bytecode, OP_NEXT);
+    bytecode_add(bytecode, var);
+    return var != NEXT_ANY_VAR;
 }
 
 static bool compile_foreign(struct ForeignCall *foreign_call, struct Memory *memory,
@@ -1181,11 +2095,11 @@ static bool compile_foreign(struct ForeignCall *foreign_call, struct Memory *mem
     }
     bytecode_add(bytecode, OP_PUSH);
     bytecode_add(bytecode, mem_loc);
-    bytecode_add(bytecode, OP_FFI_CALL);
+    bytecode_add(bytecode, foreign_call->signature ? OP_FFI_TYPED_CALL : OP_FFI_CALL);
     return true;
 }
 
-static int compile_statement(char *input, struct ForeignCall *foreign_calls,
+static int compile_statement(char *input, struct CommandIndex *commands,
         struct Memory *memory, struct Bytecode *bytecode,
         long lineno, enum Command *command_ptr)
 {
@@ -1193,7 +2107,7 @@ static int compile_statement(char *input, struct ForeignCall *foreign_calls,
 
     // Get command
     enum Command command;
-    int chars_parsed = parse_command_name(input, foreign_calls, &command);
+    int chars_parsed = parse_command_name(input, commands, &command);
     if (!chars_parsed) {
         return 0;
     }
@@ -1202,9 +2116,8 @@ static int compile_statement(char *input, struct ForeignCall *foreign_calls,
     *command_ptr = command;
 
     // Parse based on command
-    int mem_loc;
     if (command == SAVE || command == LOAD) {
-        chars_parsed = compile_expr(input, memory, bytecode);
+        chars_parsed = compile_expr(input, commands, memory, bytecode);
         if (!chars_parsed) {
             return 0;
         }
@@ -1212,13 +2125,12 @@ static int compile_statement(char *input, struct ForeignCall *foreign_calls,
     }
     switch (command) {
         case IF:
-            chars_parsed = compile_if(input, foreign_calls, memory, bytecode, lineno, command_ptr);
+            chars_parsed = compile_if(input, commands, memory, bytecode, lineno, command_ptr);
             if (!chars_parsed) {
                 return 0;
             }
             input += chars_parsed;
             break;
-#if !DBI_DISABLE_IO
         case INPUT:
             chars_parsed = compile_input(input, bytecode);
             if (!chars_parsed) {
@@ -1226,30 +2138,38 @@ static int compile_statement(char *input, struct ForeignCall *foreign_calls,
             }
             input += chars_parsed;
             break;
-#endif
         case LET:
-            chars_parsed = compile_let(input, memory, bytecode);
+            chars_parsed = compile_let(input, commands, memory, bytecode);
             if (!chars_parsed) {
                 return 0;
             }
             input += chars_parsed;
             break;
-        case GOSUB:
-            mem_loc = memory_add_int(memory, lineno + 1);
-            if (mem_loc == -1) {
+        case FOR:
+            chars_parsed = compile_for(input, commands, memory, bytecode);
+            if (!chars_parsed) {
+                return 0;
+            }
+            input += chars_parsed;
+            break;
+        case NEXT:
+            input += compile_next(input, bytecode);
+            break;
+        case DIM:
+            chars_parsed = compile_dim(input, commands, memory, bytecode);
+            if (!chars_parsed) {
                 return 0;
             }
-            bytecode_add(bytecode, OP_PUSH);
-            bytecode_add(bytecode, mem_loc);
-            bytecode_add(bytecode, OP_CALL);
-            /* fall through */
+            input += chars_parsed;
+            break;
+        case GOSUB:
         case GOTO:
-            chars_parsed = compile_expr(input, memory, bytecode);
+            chars_parsed = compile_expr(input, commands, memory, bytecode);
             if (!chars_parsed) {
                 return 0;
             }
             input += chars_parsed;
-            bytecode_add(bytecode, OP_JMP);
+            bytecode_add(bytecode, command == GOSUB ? OP_CALL : OP_JMP);
             break;
         case RETURN:
             bytecode_add(bytecode, OP_RETURN);
@@ -1273,7 +2193,7 @@ static int compile_statement(char *input, struct ForeignCall *foreign_calls,
             break;
         case REM:
             bytecode_add(bytecode, OP_NO);
-            while (*input != '\0') input++;
+            while (!prefix_line_end(*input)) input++;
             break;
 #if !DBI_DISABLE_IO
         case LOAD:
@@ -1283,26 +2203,28 @@ static int compile_statement(char *input, struct ForeignCall *foreign_calls,
             bytecode_add(bytecode, OP_SAVE);
             break;
 #endif
-        default:
-            for (int i = 0; foreign_calls != NULL; i++) {
-                if (foreign_calls->extended_command_code == (int) command) {
-                    break;
-                }
-                foreign_calls = foreign_calls->next;
-            }
-            if (foreign_calls == NULL) {
+        default: ;
+            int i = (int) command - LAST_COMMAND - 1;
+            struct ForeignCall *fc = i >= 0 && i < commands->foreign_call_count
+                ? commands->foreign_calls[i] : NULL;
+            if (fc == NULL) {
                 compile_error("command not implemented");
                 return 0;
+            } else if (fc->function) {
+                compile_error("%s is a function, and can only be used in an expression", fc->name);
+                return 0;
             }
-            if (foreign_calls->argc != 0) {
-                enum Opcode op = foreign_calls->is_macro ? OP_FFI_MACRO_ARG : OP_FFI_ARG;
-                chars_parsed = compile_print_like(input, memory, bytecode, op, foreign_calls->argc);
+            if (fc->argc != 0) {
+                enum Opcode op = fc->is_macro ? OP_FFI_MACRO_ARG
+                    : fc->borrows_args ? OP_FFI_BORROW_ARG : OP_FFI_ARG;
+                chars_parsed = compile_print_like(input, commands, memory, bytecode, op,
+                        fc->argc, fc->signature ? fc : NULL);
                 if (!chars_parsed) {
                     return 0;
                 }
                 input += chars_parsed;
             }
-            if (!compile_foreign(foreign_calls, memory, bytecode)) {
+            if (!compile_foreign(fc, memory, bytecode)) {
                 return 0;
             }
     }
@@ -1323,7 +2245,7 @@ static bool end_of_user_input_checks(char *input, struct Bytecode *bytecode, str
     }
 
     ignore_whitespace(&input);
-    if (*input != '\0') {
+    if (!prefix_line_end(*input)) {
         compile_error("unexpected input %c", *input);
         return false;
     }
@@ -1331,13 +2253,14 @@ static bool end_of_user_input_checks(char *input, struct Bytecode *bytecode, str
 }
 
 // Returns number of bytes in bytecode
-static struct Statement *compile_line(char *input, struct ForeignCall *foreign_calls,
-        struct Memory *memory, struct Bytecode *bytecode)
+// If source is set, input points into its text and the statement points into it too
+static struct Statement *compile_line(char *input, struct CommandIndex *commands,
+        struct Memory *memory, struct Bytecode *bytecode, struct Source *source)
 {
     ignore_whitespace(&input);
 
     // Ignore empty lines and # comments
-    if (*input == '\0' || *input == '#') {
+    if (prefix_line_end(*input) || *input == '#') {
         return NULL;
     }
 
@@ -1351,12 +2274,18 @@ static struct Statement *compile_line(char *input, struct ForeignCall *foreign_c
     }
     input += chars_parsed;
 
+    ignore_whitespace(&input);
+    if (lineno != 0 && prefix_line_end(*input)) {
+        size_t line_len = input - init_input + (*input == '\n');
+        return statement_deleted(lineno, init_input, line_len, source);
+    }
+
     // Compile statement(s)
     do {
         ignore_whitespace(&input);
 
         enum Command command;
-        chars_parsed = compile_statement(input, foreign_calls, memory, bytecode, lineno, &command);
+        chars_parsed = compile_statement(input, commands, memory, bytecode, lineno, &command);
         if (!chars_parsed) {
             memory_clear(memory);
             return NULL;
@@ -1380,38 +2309,207 @@ static struct Statement *compile_line(char *input, struct ForeignCall *foreign_c
         memory_clear(memory);
         return NULL;
     }
-    return statement_new(lineno, init_input, memory, bytecode);
-}
 
-// *******************************************************************
-// ************************* VM / Execution ************************** 
-// *******************************************************************
-struct Runtime {
-    struct DbiObject **vars;
-    void *context;
-    bool run_file;
-    struct Statement *input_stmt;
-    long lineno;
-    char *filename;
-    int callstack_offset;
-    int *callstack;
-    // Reference to current program being executed
-    struct Program *program;
-    // Current args
-    int ffi_argc;
-    struct DbiObject **ffi_argv;
-};
+    // Line text includes the newline, if there is one
+    ignore_whitespace(&input);
+    size_t line_len = input - init_input + (*input == '\n');
+    return statement_new(lineno, init_input, line_len, source, memory, bytecode);
+}
 
-static void objs_init(struct DbiObject **vars, int count)
+void temps_init(char *input, struct Memory *temp_memory, struct Bytecode *temp_bytecode)
 {
-    for (int i = 0; i < count; i++) {
-        vars[i] = malloc(sizeof(**vars));
-        vars[i]->type = DBI_INT;
-        vars[i]->bint = 0;
+    if (input) {
+        memset(input, 0, DBI_MAX_LINE_LENGTH);
     }
+
+    temp_memory->index = 0;
+    memset(temp_memory->array, 0, sizeof(*temp_memory->array) * DBI_MAX_LINE_MEMORY);
+
+    temp_bytecode->index = 0;
+    memset(temp_bytecode->array, 0, DBI_MAX_BYTECODE);
+
+    global_lineno = -1;
 }
 
-static void objs_free(struct DbiObject **vars, int count)
+// Lazy compilation only checks the line number and the first command name up front. The rest of
+// the line is compiled the first time it runs.
+static struct Statement *index_line(char *input, struct CommandIndex *commands,
+        struct Source *source)
+{
+    ignore_whitespace(&input);
+
+    // Ignore empty lines and # comments
+    if (prefix_line_end(*input) || *input == '#') {
+        return NULL;
+    }
+
+    char *init_input = input;
+    long lineno = 0;
+    int chars_parsed = parse_lineno(input, &lineno);
+    if (chars_parsed == -1) {
+        return NULL;
+    }
+    input += chars_parsed;
+    ignore_whitespace(&input);
+
+    if (prefix_line_end(*input)) {
+        size_t line_len = input - init_input + (*input == '\n');
+        return statement_deleted(lineno, init_input, line_len, source);
+    }
+    enum Command command;
+    if (!parse_command_name(input, commands, &command)) {
+        return NULL;
+    }
+    while (!prefix_line_end(*input)) input++;
+    size_t line_len = input - init_input + (*input == '\n');
+    return statement_new(lineno, init_input, line_len, source, NULL, NULL);
+}
+
+// Statements can be shared by runtimes on different threads, so only one thread compiles a lazy
+// statement and any others wait for it to finish
+static bool statement_compile_lazy(struct Statement *stmt, struct CommandIndex *commands)
+{
+    int state = STATEMENT_LAZY;
+    while (!atomic_compare_exchange_weak(&stmt->compile_state, &state, STATEMENT_COMPILING)) {
+        if (state == STATEMENT_COMPILED) {
+            return true;
+        }
+        state = STATEMENT_LAZY;
+        sched_yield();
+    }
+
+    struct DbiObject *temp_memory_array[DBI_MAX_LINE_MEMORY];
+    struct Memory temp_memory = { 0, temp_memory_array };
+
+    uint8_t temp_bytecode_array[DBI_MAX_BYTECODE];
+    struct Bytecode temp_bytecode = { 0, temp_bytecode_array };
+
+    temps_init(NULL, &temp_memory, &temp_bytecode);
+    long old_lineno = global_lineno;
+    struct Statement *compiled = compile_line(stmt->line, commands, &temp_memory,
+            &temp_bytecode, stmt->source);
+    global_lineno = old_lineno;
+    if (!compiled) {
+        atomic_store(&stmt->compile_state, STATEMENT_LAZY);
+        return false;
+    }
+    stmt->memory = compiled->memory;
+    stmt->bytecode = compiled->bytecode;
+    compiled->memory = NULL;
+    compiled->bytecode = NULL;
+    statement_free(compiled);
+    atomic_store_explicit(&stmt->compile_state, STATEMENT_COMPILED, memory_order_release);
+    return true;
+}
+
+static bool statement_is_compiled(struct Statement *stmt)
+{
+    return atomic_load_explicit(&stmt->compile_state, memory_order_acquire) == STATEMENT_COMPILED;
+}
+
+// Compiles every lazy statement, for anything that needs bytecode of the whole program
+static bool program_compile_lazy(struct Statement **statements, struct CommandIndex *commands)
+{
+    bool ret = true;
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (stmt && !statement_is_compiled(stmt)) {
+            ret = statement_compile_lazy(stmt, commands) && ret;
+        }
+    }
+    return ret;
+}
+
+// *******************************************************************
+// ************************* VM / Execution ************************** 
+// *******************************************************************
+// Variables are shared copy-on-write between forked runtimes
+struct Variables {
+    atomic_int refcount;
+    struct DbiObject array[DBI_MAX_VARS];
+};
+
+// Arrays are also shared copy-on-write, but each one separately, so that writing to an array
+// does not copy the others
+struct Array {
+    atomic_int refcount;
+    long size;
+    long data[];
+};
+
+#define CALL_STACK_INITIAL_SIZE 16
+
+// GOSUB that has not returned yet. RETURN resumes just after the GOSUB instruction, so the rest
+// of the line still runs.
+struct CallFrame {
+    struct Statement *stmt;
+    long ip; // Position of the GOSUB instruction
+};
+
+// Running FOR loop. NEXT jumps back to just after the FOR instruction.
+struct LoopFrame {
+    struct Statement *stmt;
+    long ip; // Position of the FOR instruction's argument
+    long limit;
+    long step;
+    uint8_t var;
+};
+
+struct Runtime {
+    struct Variables *vars;
+    struct Array *arrays[DBI_MAX_VARS]; // NULL until dimensioned
+    void *context;
+    bool run_file;
+    struct Statement *input_stmt;
+    long lineno;
+    long ip; // Non-zero if execution should resume partway through line
+    int64_t deadline; // Monotonic time in nanoseconds, or 0 if there is no deadline
+    char *filename;
+    int callstack_offset; // Number of GOSUB's that have not returned
+    int callstack_size; // Grows up to DBI_MAX_CALL_STACK
+    struct CallFrame *callstack;
+    int loop_offset; // Number of running FOR loops
+    struct LoopFrame *loops;
+    // Reference to current program being executed, and the version of it this runtime has pinned
+    // (or NULL if it is not running)
+    struct Program *program;
+    struct Version *version;
+    // Current args (allocated on first foreign call that takes arguments)
+    int ffi_argc;
+    struct DbiObject **ffi_argv;
+    // Current args of command that borrows them. Strings point to constants / variables in place.
+    bool ffi_borrowed;
+    struct DbiObject ffi_views[DBI_MAX_LINE_MEMORY];
+    struct DbiObject *ffi_view_ptrs[DBI_MAX_LINE_MEMORY];
+    struct AsyncJob *async_job; // Async command runtime is waiting for, or NULL
+    bool in_repl; // The repl can't wait for async commands, so they are run in place
+    // Monotonic time in milliseconds that a sleeping runtime wakes up at, or 0 if not sleeping
+    int64_t wake_ms;
+    struct Timers *timers; // Timers the runtime sleeps on, or NULL if it sleeps in place
+    struct Runtime *timer_next;
+    struct Runtime **timer_pprev; // Pointer to this runtime in its timer list, or NULL
+    bool timer_due; // In the due list rather than the wheel
+    // If set, INPUT suspends the runtime until the host provides input, instead of reading stdin
+    bool suspend_on_input;
+    char *input_text; // Provided by the host for the next INPUT, or NULL
+    // Output is buffered until it is full or flushed, and then written with output_write (or to
+    // stdout, if it is NULL)
+    DbiOutput output_write;
+    void *output_ctx;
+    size_t output_len;
+    char output[DBI_OUTPUT_BUFFER];
+};
+
+static void objs_init(struct DbiObject **vars, int count)
+{
+    for (int i = 0; i < count; i++) {
+        vars[i] = malloc(sizeof(**vars));
+        vars[i]->type = DBI_INT;
+        vars[i]->bint = 0;
+    }
+}
+
+static void objs_free(struct DbiObject **vars, int count)
 {
     for (int i = 0; i < count; i++) {
         if (vars[i]->type == DBI_STR && vars[i]->bstr != NULL) {
@@ -1421,20 +2519,160 @@ static void objs_free(struct DbiObject **vars, int count)
     }
 }
 
+static struct Variables *variables_new(void)
+{
+    // Zeroed memory is the same as every variable being set to integer 0
+    struct Variables *vars = calloc(1, sizeof(*vars));
+    atomic_init(&vars->refcount, 1);
+    return vars;
+}
+
+static void variables_release(struct Variables *vars)
+{
+    if (atomic_fetch_sub(&vars->refcount, 1) != 1) {
+        return;
+    }
+    for (int i = 0; i < DBI_MAX_VARS; i++) {
+        if (vars->array[i].type == DBI_STR && vars->array[i].bstr != NULL) {
+            free(vars->array[i].bstr);
+        }
+    }
+    free(vars);
+}
+
+// Must be called before modifying any variable. If the variables are shared with another
+// runtime, this gives the runtime its own copy.
+static struct DbiObject *variables_unshare(struct Runtime *runtime)
+{
+    struct Variables *vars = runtime->vars;
+    if (atomic_load(&vars->refcount) == 1) {
+        return vars->array;
+    }
+    struct Variables *copy = malloc(sizeof(*copy));
+    atomic_init(&copy->refcount, 1);
+    memcpy(copy->array, vars->array, sizeof(copy->array));
+    for (int i = 0; i < DBI_MAX_VARS; i++) {
+        if (copy->array[i].type == DBI_STR && copy->array[i].bstr != NULL) {
+            copy->array[i].bstr = strdup(copy->array[i].bstr);
+        }
+    }
+    variables_release(vars);
+    runtime->vars = copy;
+    return copy->array;
+}
+
+static struct Array *array_new(long size)
+{
+    struct Array *array = calloc(1, sizeof(*array) + size * sizeof(*array->data));
+    atomic_init(&array->refcount, 1);
+    array->size = size;
+    return array;
+}
+
+static void array_release(struct Array *array)
+{
+    if (array && atomic_fetch_sub(&array->refcount, 1) == 1) {
+        free(array);
+    }
+}
+
+static void arrays_release(struct Array **arrays)
+{
+    for (int i = 0; i < DBI_MAX_VARS; i++) {
+        array_release(arrays[i]);
+    }
+}
+
+// Must be called before modifying a dimensioned array
+static struct Array *array_unshare(struct Runtime *runtime, uint8_t var)
+{
+    struct Array *array = runtime->arrays[var];
+    if (atomic_load(&array->refcount) == 1) {
+        return array;
+    }
+    struct Array *copy = array_new(array->size);
+    memcpy(copy->data, array->data, array->size * sizeof(*array->data));
+    array_release(array);
+    runtime->arrays[var] = copy;
+    return copy;
+}
+
+static struct DbiObject **runtime_ffi_argv(struct Runtime *runtime)
+{
+    if (runtime->ffi_argv == NULL) {
+        // Shouldn't be possible to have more command args than memory
+        runtime->ffi_argv = calloc(DBI_MAX_LINE_MEMORY, sizeof(*runtime->ffi_argv));
+        objs_init(runtime->ffi_argv, DBI_MAX_LINE_MEMORY);
+    }
+    return runtime->ffi_argv;
+}
+
 DbiRuntime dbi_runtime_new(void)
 {
     struct Runtime *runtime = malloc(sizeof(*runtime));
     memset(runtime, 0, sizeof(*runtime));
-    runtime->vars = calloc(DBI_MAX_VARS, sizeof(*runtime->vars));
-    objs_init(runtime->vars, DBI_MAX_VARS);
+    runtime->vars = variables_new();
     runtime->lineno = 1;
+    runtime->callstack_size = CALL_STACK_INITIAL_SIZE;
+    runtime->callstack = calloc(runtime->callstack_size, sizeof(*runtime->callstack));
+    runtime->loops = calloc(DBI_MAX_LOOP_STACK, sizeof(*runtime->loops));
+    // Without stdin, INPUT can only read input provided by the host
+    runtime->suspend_on_input = DBI_DISABLE_IO;
+    return (DbiRuntime) runtime;
+}
 
-    // Shouldn't be possible to have more command args than memory
-    runtime->ffi_argv = calloc(DBI_MAX_LINE_MEMORY, sizeof(*runtime->ffi_argv));
-    objs_init(runtime->ffi_argv, DBI_MAX_LINE_MEMORY);
+static void timers_add(struct Timers *timers, struct Runtime *runtime);
 
-    runtime->callstack = calloc(DBI_MAX_CALL_STACK, sizeof(*runtime->callstack));
-    return (DbiRuntime) runtime;
+DbiRuntime dbi_runtime_fork(DbiRuntime dbi)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert(!runtime->async_job);
+    struct Runtime *fork = malloc(sizeof(*fork));
+    memset(fork, 0, sizeof(*fork));
+
+    atomic_fetch_add(&runtime->vars->refcount, 1);
+    fork->vars = runtime->vars;
+    for (int i = 0; i < DBI_MAX_VARS; i++) {
+        if (runtime->arrays[i]) {
+            atomic_fetch_add(&runtime->arrays[i]->refcount, 1);
+            fork->arrays[i] = runtime->arrays[i];
+        }
+    }
+
+    fork->context = runtime->context;
+    fork->run_file = runtime->run_file;
+    fork->lineno = runtime->lineno;
+    fork->ip = runtime->ip;
+    // A fork of a sleeping runtime sleeps until the same time on the same timers
+    fork->wake_ms = runtime->wake_ms;
+    fork->timers = runtime->timers;
+    if (runtime->timer_pprev) {
+        timers_add(fork->timers, fork);
+    }
+    fork->suspend_on_input = runtime->suspend_on_input;
+    fork->output_write = runtime->output_write;
+    fork->output_ctx = runtime->output_ctx;
+    if (runtime->input_text) {
+        fork->input_text = strdup(runtime->input_text);
+    }
+    fork->filename = runtime->filename;
+    fork->program = runtime->program;
+    // Fork resumes on the same version as the original
+    fork->version = runtime->version;
+    if (fork->version) {
+        atomic_fetch_add(&fork->version->refs, 1);
+    }
+
+    fork->callstack_offset = runtime->callstack_offset;
+    fork->callstack_size = runtime->callstack_size;
+    fork->callstack = malloc(fork->callstack_size * sizeof(*fork->callstack));
+    memcpy(fork->callstack, runtime->callstack,
+            runtime->callstack_offset * sizeof(*fork->callstack));
+
+    fork->loop_offset = runtime->loop_offset;
+    fork->loops = malloc(DBI_MAX_LOOP_STACK * sizeof(*fork->loops));
+    memcpy(fork->loops, runtime->loops, runtime->loop_offset * sizeof(*fork->loops));
+    return (DbiRuntime) fork;
 }
 
 static DbiRuntime runtime_new_with_program(struct Program *program)
@@ -1444,28 +2682,288 @@ static DbiRuntime runtime_new_with_program(struct Program *program)
     return (DbiRuntime)runtime;
 }
 
+/*
+ * Async commands run on a pool of DBI_ASYNC_THREADS threads shared by every program, which is
+ * started the first time one is called. A job is owned by the runtime waiting for it, unless the
+ * runtime is freed first, in which case the worker frees it once it finishes.
+ */
+struct AsyncJob {
+    struct ForeignCall *fc;
+    DbiAsyncCall call; // Copied, since the program may be freed before the job runs
+    void *context;
+    int argc;
+    union DbiValue args[DBI_MAX_LINE_MEMORY]; // Strings are copies
+    char types[DBI_MAX_LINE_MEMORY];
+    enum DbiStatus status;
+    bool done; // Guarded by pool lock
+    bool abandoned; // Guarded by pool lock
+    struct AsyncJob *next;
+};
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    struct AsyncJob *head;
+    struct AsyncJob *tail;
+    int fds[2]; // Pipe that a byte is written to whenever a job finishes
+} async_pool = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, { -1, -1 } };
+
+static void async_job_free(struct AsyncJob *job)
+{
+    for (int i = 0; i < job->argc; i++) {
+        if (job->types[i] == 'S') {
+            free((char *) job->args[i].bstr);
+        }
+    }
+    free(job);
+}
+
+static void *async_worker(void *arg)
+{
+    IGNORE(arg);
+    while (true) {
+        pthread_mutex_lock(&async_pool.lock);
+        while (async_pool.head == NULL) {
+            pthread_cond_wait(&async_pool.has_jobs, &async_pool.lock);
+        }
+        struct AsyncJob *job = async_pool.head;
+        async_pool.head = job->next;
+        if (async_pool.head == NULL) {
+            async_pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&async_pool.lock);
+
+        enum DbiStatus status = job->call(job->context, job->argc, job->args);
+
+        pthread_mutex_lock(&async_pool.lock);
+        job->status = status;
+        job->done = true;
+        bool abandoned = job->abandoned;
+        pthread_mutex_unlock(&async_pool.lock);
+        if (abandoned) {
+            async_job_free(job);
+        } else {
+            // If the pipe is full, it is already readable
+            ssize_t written = write(async_pool.fds[1], "", 1);
+            IGNORE(written);
+        }
+    }
+    return NULL;
+}
+
+static void async_pool_init(void)
+{
+    if (pipe(async_pool.fds) != 0) {
+        perror("dbi: could not create async completion pipe");
+        abort();
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(async_pool.fds[i], F_SETFL, fcntl(async_pool.fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(async_pool.fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < DBI_ASYNC_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, async_worker, NULL) != 0) {
+            perror("dbi: could not start async worker");
+            abort();
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Copies arguments and queues call. The runtime waits for it until it is finished.
+static void async_submit(struct Runtime *runtime, struct ForeignCall *fc, union DbiValue *args)
+{
+    pthread_once(&async_pool.once, async_pool_init);
+    struct AsyncJob *job = calloc(1, sizeof(*job));
+    job->fc = fc;
+    job->call = fc->async_call;
+    job->context = runtime->context;
+    job->argc = runtime->ffi_argc;
+    for (int i = 0; i < job->argc; i++) {
+        job->types[i] = signature_type(fc, i);
+        job->args[i] = args[i];
+        if (job->types[i] == 'S') {
+            job->args[i].bstr = strdup(args[i].bstr);
+        }
+    }
+    runtime->async_job = job;
+
+    pthread_mutex_lock(&async_pool.lock);
+    if (async_pool.tail) {
+        async_pool.tail->next = job;
+    } else {
+        async_pool.head = job;
+    }
+    async_pool.tail = job;
+    pthread_cond_signal(&async_pool.has_jobs);
+    pthread_mutex_unlock(&async_pool.lock);
+}
+
+// Returns false if runtime's async job is still running. Otherwise the job is freed and its
+// status is stored in status_ptr.
+static bool async_finish(struct Runtime *runtime, enum DbiStatus *status_ptr)
+{
+    struct AsyncJob *job = runtime->async_job;
+    pthread_mutex_lock(&async_pool.lock);
+    bool done = job->done;
+    pthread_mutex_unlock(&async_pool.lock);
+    if (!done) {
+        return false;
+    }
+    *status_ptr = job->status;
+    runtime->async_job = NULL;
+    async_job_free(job);
+    return true;
+}
+
+// Frees the runtime's job, or leaves it to the worker if it is still running
+static void async_abandon(struct Runtime *runtime)
+{
+    struct AsyncJob *job = runtime->async_job;
+    runtime->async_job = NULL;
+    pthread_mutex_lock(&async_pool.lock);
+    bool done = job->done;
+    job->abandoned = true;
+    pthread_mutex_unlock(&async_pool.lock);
+    if (done) {
+        async_job_free(job);
+    }
+}
+
+int dbi_async_fd(void)
+{
+    pthread_once(&async_pool.once, async_pool_init);
+    return async_pool.fds[0];
+}
+
+static void output_write(struct Runtime *runtime, const char *buf, size_t len)
+{
+    if (runtime->output_write) {
+        runtime->output_write(runtime->output_ctx, buf, len);
+    } else {
+        fwrite(buf, 1, len, stdout);
+        fflush(stdout);
+    }
+}
+
+static void runtime_flush(struct Runtime *runtime)
+{
+    if (runtime->output_len > 0) {
+        output_write(runtime, runtime->output, runtime->output_len);
+        runtime->output_len = 0;
+    }
+}
+
+void dbi_set_output(DbiRuntime dbi, DbiOutput write, void *ctx)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    runtime_flush(runtime);
+    runtime->output_write = write;
+    runtime->output_ctx = ctx;
+}
+
+void dbi_write(DbiRuntime dbi, const char *buf, size_t len)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    if (runtime->output_len + len > DBI_OUTPUT_BUFFER) {
+        runtime_flush(runtime);
+        if (len > DBI_OUTPUT_BUFFER) {
+            // Too large to buffer, so is written straight through
+            output_write(runtime, buf, len);
+            return;
+        }
+    }
+    memcpy(runtime->output + runtime->output_len, buf, len);
+    runtime->output_len += len;
+}
+
+void dbi_write_int(DbiRuntime dbi, long num)
+{
+    // Digits are written from the end, and unsigned so that LONG_MIN can be negated
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *digits = end;
+    unsigned long unum = num < 0 ? -(unsigned long) num : (unsigned long) num;
+    do {
+        *--digits = '0' + unum % 10;
+        unum /= 10;
+    } while (unum != 0);
+    if (num < 0) {
+        *--digits = '-';
+    }
+    dbi_write(dbi, digits, end - digits);
+}
+
+void dbi_flush(DbiRuntime dbi)
+{
+    runtime_flush((struct Runtime *) dbi);
+}
+
 // Allows runtime to be re-used if program has finished
 static void dbi_runtime_reset(struct Runtime *runtime)
 {
     runtime->callstack_offset = 0;
+    runtime->loop_offset = 0;
     runtime->lineno = 1;
+    runtime->ip = 0;
     runtime->ffi_argc = 0;
+    runtime->ffi_borrowed = false;
+    if (runtime->version) {
+        version_unpin(runtime->program, runtime->version);
+        runtime->version = NULL;
+    }
+}
+
+// Pins current version of program, unless runtime is already running a version of it
+static struct Version *runtime_pin(struct Runtime *runtime, struct Program *program)
+{
+    if (runtime->version && runtime->program != program) {
+        version_unpin(runtime->program, runtime->version);
+        runtime->version = NULL;
+        runtime->callstack_offset = 0;
+        runtime->loop_offset = 0;
+    }
+    runtime->program = program;
+    if (!runtime->version) {
+        runtime->version = version_pin(program);
+    }
+    return runtime->version;
 }
 
+static void timers_remove(struct Runtime *runtime);
+
 void dbi_runtime_free(DbiRuntime dbi)
 {
     struct Runtime *runtime = (struct Runtime *) dbi;
-    objs_free(runtime->vars, DBI_MAX_VARS);
+    runtime_flush(runtime);
+    timers_remove(runtime);
+    variables_release(runtime->vars);
+    arrays_release(runtime->arrays);
+    if (runtime->version) {
+        version_unpin(runtime->program, runtime->version);
+    }
     if (runtime->input_stmt) {
         statement_free(runtime->input_stmt);
         runtime->input_stmt = NULL;
     }
-    free(runtime->vars);
 
-    objs_free(runtime->ffi_argv, DBI_MAX_LINE_MEMORY);
-    free(runtime->ffi_argv);
+    if (runtime->ffi_argv) {
+        objs_free(runtime->ffi_argv, DBI_MAX_LINE_MEMORY);
+        free(runtime->ffi_argv);
+    }
+    if (runtime->async_job) {
+        async_abandon(runtime);
+    }
+    free(runtime->input_text);
 
     free(runtime->callstack);
+    free(runtime->loops);
     free(runtime);
 }
 
@@ -1490,38 +2988,305 @@ void dbi_runtime_error(DbiRuntime dbi, const char *fmt, ...)
     global_lineno = old_lineno;\
 } while (0)
 
-// Compile input into a bunch of OP_LETs - kinda hacky but I can't think of a better way
-static struct Statement *execute_input(struct Statement *stmt, int var_count, uint8_t *var_list)
+static int64_t monotonic_ns(void)
 {
-    global_lineno = stmt->lineno;
-    char input_arr[DBI_MAX_LINE_LENGTH] = {0};
-    char *input = input_arr; // Decay to pointer, please
-    char *init_input = input;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    if (!fgets(input, DBI_MAX_LINE_LENGTH, stdin)) {
-        compile_error("unexpected end of input");
-        return NULL;
+static int64_t monotonic_ms(void)
+{
+    return monotonic_ns() / 1000000;
+}
+
+/*
+ * Hierarchical timer wheel of sleeping runtimes, ticking once per millisecond. Level 0 has a slot
+ * for each of the next TIMER_SLOTS ticks, and each slot of level n covers TIMER_SLOTS slots of
+ * level n - 1. When the tick reaches the start of a slot in a higher level, its runtimes are moved
+ * down a level, so adding, removing and waking a runtime are all O(1). Runtimes sleeping for
+ * longer than the wheel covers are added to its last slot, and moved back up when they reach it.
+ */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+struct Timers {
+    int64_t tick; // Time in milliseconds that the wheel has advanced to
+    long count; // Runtimes in wheel, not counting those that are due
+    struct Runtime *slots[TIMER_LEVELS][TIMER_SLOTS];
+    struct Runtime *due; // Runtimes that have woken up but have not been returned yet
+};
+
+static void timer_link(struct Runtime **list, struct Runtime *runtime)
+{
+    runtime->timer_next = *list;
+    if (*list) {
+        (*list)->timer_pprev = &runtime->timer_next;
     }
+    *list = runtime;
+    runtime->timer_pprev = list;
+}
 
-    uint8_t temp_bytecode_array[DBI_MAX_BYTECODE] = {0};
-    struct Bytecode temp_bytecode = { 0, temp_bytecode_array };
+static void timer_unlink(struct Runtime *runtime)
+{
+    if (!runtime->timer_pprev) {
+        return;
+    }
+    *runtime->timer_pprev = runtime->timer_next;
+    if (runtime->timer_next) {
+        runtime->timer_next->timer_pprev = runtime->timer_pprev;
+    }
+    runtime->timer_next = NULL;
+    runtime->timer_pprev = NULL;
+}
 
-    struct DbiObject *temp_memory_array[DBI_MAX_LINE_MEMORY] = {0};
-    struct Memory temp_memory = { 0, temp_memory_array };
+// Removes runtime from its timers, if it is sleeping on them
+static void timers_remove(struct Runtime *runtime)
+{
+    if (runtime->timer_pprev && !runtime->timer_due) {
+        runtime->timers->count--;
+    }
+    timer_unlink(runtime);
+}
 
-    int current_var_count = 0;
-    do {
-        int char_count = 0;
-        ignore_whitespace(&input);
+static void timers_add(struct Timers *timers, struct Runtime *runtime)
+{
+    int64_t delta = runtime->wake_ms - timers->tick;
+    runtime->timer_due = delta <= 0;
+    if (runtime->timer_due) {
+        timer_link(&timers->due, runtime);
+        return;
+    }
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (int64_t) 1 << (TIMER_BITS * (level + 1))) {
+        level++;
+    }
+    int64_t wake_ms = runtime->wake_ms;
+    if (delta >= (int64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) {
+        wake_ms = timers->tick + ((int64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+    int slot = (wake_ms >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+    timer_link(&timers->slots[level][slot], runtime);
+    timers->count++;
+}
 
-        // Compile expression
-        if (prefix_expr(*input)) {
-            char_count = compile_expr(input, &temp_memory, &temp_bytecode);
-            if (!char_count) {
+// Moves the runtimes in a slot to the level below, or to the due list
+static void timers_cascade(struct Timers *timers, int level, int slot)
+{
+    struct Runtime *runtime = timers->slots[level][slot];
+    timers->slots[level][slot] = NULL;
+    while (runtime) {
+        struct Runtime *next = runtime->timer_next;
+        runtime->timer_pprev = NULL;
+        timers->count--;
+        timers_add(timers, runtime);
+        runtime = next;
+    }
+}
+
+static void timers_advance(struct Timers *timers, int64_t now)
+{
+    if (timers->count == 0) {
+        timers->tick = now > timers->tick ? now : timers->tick;
+        return;
+    }
+    while (timers->tick < now) {
+        timers->tick++;
+        // Higher levels first, since their runtimes may be moved into the slots below
+        int level = 0;
+        while (level < TIMER_LEVELS - 1
+                && (timers->tick & (((int64_t) 1 << (TIMER_BITS * (level + 1))) - 1)) == 0) {
+            level++;
+        }
+        for (; level > 0; level--) {
+            timers_cascade(timers, level,
+                    (timers->tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1));
+        }
+        timers_cascade(timers, 0, timers->tick & (TIMER_SLOTS - 1));
+        if (timers->count == 0) {
+            timers->tick = now;
+        }
+    }
+}
+
+DbiTimers dbi_timers_new(void)
+{
+    struct Timers *timers = calloc(1, sizeof(*timers));
+    timers->tick = monotonic_ms();
+    return (DbiTimers) timers;
+}
+
+static void timers_release_list(struct Runtime *runtime)
+{
+    while (runtime) {
+        struct Runtime *next = runtime->timer_next;
+        runtime->timer_next = NULL;
+        runtime->timer_pprev = NULL;
+        runtime->timers = NULL;
+        runtime = next;
+    }
+}
+
+void dbi_timers_free(DbiTimers t)
+{
+    struct Timers *timers = (struct Timers *) t;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            timers_release_list(timers->slots[level][slot]);
+        }
+    }
+    timers_release_list(timers->due);
+    free(timers);
+}
+
+long dbi_timers_timeout(DbiTimers t)
+{
+    struct Timers *timers = (struct Timers *) t;
+    if (timers->due) {
+        return 0;
+    } else if (timers->count == 0) {
+        return -1;
+    }
+    // Earliest tick that a slot holding runtimes is reached. Runtimes in higher levels may wake
+    // later than the slot starts, in which case the host just advances the timers early.
+    int64_t next = INT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_BITS * level;
+        for (int i = 1; i <= TIMER_SLOTS; i++) {
+            int64_t start = ((timers->tick >> shift) + i) << shift;
+            if (timers->slots[level][(start >> shift) & (TIMER_SLOTS - 1)]) {
+                next = start < next ? start : next;
+                break;
+            }
+        }
+    }
+    int64_t now = monotonic_ms();
+    return next <= now ? 0 : (long) (next - now);
+}
+
+int dbi_timers_advance(DbiTimers t, DbiRuntime *ready, int size)
+{
+    struct Timers *timers = (struct Timers *) t;
+    timers_advance(timers, monotonic_ms());
+    int count = 0;
+    while (count < size && timers->due) {
+        struct Runtime *runtime = timers->due;
+        timer_unlink(runtime);
+        ready[count++] = (DbiRuntime) runtime;
+    }
+    return count;
+}
+
+void dbi_set_timers(DbiRuntime dbi, DbiTimers timers)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert(!runtime->timer_pprev);
+    runtime->timers = (struct Timers *) timers;
+}
+
+enum DbiStatus dbi_runtime_sleep(DbiRuntime dbi, long ms)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    if (ms <= 0) {
+        return DBI_STATUS_GOOD;
+    } else if (!runtime->timers) {
+        runtime_flush(runtime);
+        struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+        return DBI_STATUS_GOOD;
+    }
+    runtime->wake_ms = monotonic_ms() + ms;
+    timers_add(runtime->timers, runtime);
+    return DBI_STATUS_WAITING;
+}
+
+// Fast path for input that is just comma separated integers and strings, which sets variables
+// directly instead of compiling the input. Returns false without setting anything if the input
+// is anything else (including invalid input), which is then left to execute_input.
+static bool input_literals(struct Runtime *runtime, char *input, int var_count, uint8_t *var_list)
+{
+    struct DbiObject values[DBI_MAX_LINE_MEMORY];
+    int count = 0;
+    bool ok = true;
+    while (ok) {
+        ignore_whitespace(&input);
+        char *start = input;
+        if (*input == '"') {
+            input++;
+            while (*input != '"' && !prefix_line_end(*input)) input++;
+            if (*input != '"') {
+                ok = false;
+                break;
+            }
+            values[count].type = DBI_STR;
+            values[count].bstr = malloc(input - start);
+            memcpy(values[count].bstr, start + 1, input - start - 1);
+            values[count].bstr[input - start - 1] = '\0';
+            input++;
+        } else if (isdigit(*input) || ((*input == '-' || *input == '+') && isdigit(input[1]))) {
+            errno = 0;
+            values[count].type = DBI_INT;
+            values[count].bint = strtol(start, &input, 10);
+            ok = errno == 0;
+        } else {
+            ok = false;
+            break;
+        }
+        count++;
+        ignore_whitespace(&input);
+        if (prefix_line_end(*input)) {
+            break;
+        }
+        ok = ok && *input == ',' && count < var_count;
+        input++;
+    }
+    ok = ok && count == var_count;
+    if (ok) {
+        struct DbiObject *vars = variables_unshare(runtime);
+        for (int i = 0; i < count; i++) {
+            if (vars[var_list[i]].type == DBI_STR) {
+                free(vars[var_list[i]].bstr);
+            }
+            vars[var_list[i]] = values[i];
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            if (values[i].type == DBI_STR) {
+                free(values[i].bstr);
+            }
+        }
+    }
+    return ok;
+}
+
+// Compile input into a bunch of OP_LETs - kinda hacky but I can't think of a better way
+// Input is the text of one line, either read from stdin or provided by the host
+static struct Statement *execute_input(struct Statement *stmt, int var_count, uint8_t *var_list,
+        char *input)
+{
+    global_lineno = stmt->lineno;
+    char *init_input = input;
+
+    uint8_t temp_bytecode_array[DBI_MAX_BYTECODE] = {0};
+    struct Bytecode temp_bytecode = { 0, temp_bytecode_array };
+
+    struct DbiObject *temp_memory_array[DBI_MAX_LINE_MEMORY] = {0};
+    struct Memory temp_memory = { 0, temp_memory_array };
+
+    int current_var_count = 0;
+    do {
+        int char_count = 0;
+        ignore_whitespace(&input);
+
+        // Compile expression
+        if (prefix_expr(*input)) {
+            char_count = compile_expr(input, NULL, &temp_memory, &temp_bytecode);
+            if (!char_count) {
                 memory_clear(&temp_memory);
                 return NULL;
             }
-        } else if (*input == '\0') {
+        } else if (prefix_line_end(*input)) {
             compile_error("unexpected end of input");
             memory_clear(&temp_memory);
             return NULL;
@@ -1544,7 +3309,7 @@ static struct Statement *execute_input(struct Statement *stmt, int var_count, ui
         ignore_whitespace(&input);
         if (*input == ',') {
             input++;
-        } else if (*input == '\0') {
+        } else if (prefix_line_end(*input)) {
             break;
         }
         current_var_count++;
@@ -1561,7 +3326,8 @@ static struct Statement *execute_input(struct Statement *stmt, int var_count, ui
         return NULL;
     }
 
-    return statement_new(global_lineno, init_input, &temp_memory, &temp_bytecode);
+    return statement_new(global_lineno, init_input, strlen(init_input), NULL, &temp_memory,
+            &temp_bytecode);
 }
 
 #define push(val)\
@@ -1576,28 +3342,116 @@ static struct Statement *execute_input(struct Statement *stmt, int var_count, ui
 #define pop()\
     &(stack[stack_offset--])
 
-#define push_sub(line)\
-    callstack[++callstack_offset] = line
+// Fills in args of typed command or function from objs. Returns index of first argument of the
+// wrong type, or -1 if there is none.
+static int ffi_typed_args(struct ForeignCall *fc, struct DbiObject *objs, int count,
+        struct DbiObject *vars, union DbiValue *args)
+{
+    for (int i = 0; i < count; i++) {
+        struct DbiObject *obj = &objs[i];
+        if (obj->type == DBI_VAR) {
+            obj = &vars[obj->bvar];
+        }
+        if (signature_type(fc, i) == 'I') {
+            if (obj->type != DBI_INT) {
+                return i;
+            }
+            args[i].bint = obj->bint;
+        } else {
+            if (obj->type != DBI_STR) {
+                return i;
+            }
+            args[i].bstr = obj->bstr;
+        }
+    }
+    return -1;
+}
+
+// Reports error if async command did not succeed
+static enum DbiStatus async_status(struct ForeignCall *fc, long lineno, enum DbiStatus status)
+{
+    if (status == DBI_STATUS_GOOD) {
+        return status;
+    } else if (status != DBI_STATUS_ERROR) {
+        runtime_error(lineno, "async command %s can only succeed or fail", fc->name);
+    } else {
+        runtime_error(lineno, "%s failed", fc->name);
+    }
+    return DBI_STATUS_ERROR;
+}
+
+// Suspends runtime so that it can be resumed at the given position
+static enum DbiStatus deadline_exceeded(struct Runtime *runtime, long lineno,
+        long resume_lineno, long resume_ip)
+{
+    runtime_error(lineno, "deadline exceeded");
+    runtime->lineno = resume_lineno;
+    runtime->ip = resume_ip;
+    return DBI_STATUS_TIMEOUT;
+}
+
+// Returns frame for a new GOSUB, or NULL if the call stack is full
+static struct CallFrame *callstack_push(struct Runtime *runtime)
+{
+    if (runtime->callstack_offset >= runtime->callstack_size) {
+        if (runtime->callstack_size >= DBI_MAX_CALL_STACK) {
+            return NULL;
+        }
+        runtime->callstack_size = runtime->callstack_size * 2 < DBI_MAX_CALL_STACK
+            ? runtime->callstack_size * 2 : DBI_MAX_CALL_STACK;
+        runtime->callstack = realloc(runtime->callstack,
+                runtime->callstack_size * sizeof(*runtime->callstack));
+    }
+    return &runtime->callstack[runtime->callstack_offset++];
+}
+
+// Only used at safepoints. Reading the clock is comparatively slow, so it is only done once
+// every DBI_DEADLINE_POLL_INTERVAL iterations.
+#define check_deadline(resume_lineno, resume_ip) do {\
+    if (iter >= next_poll) {\
+        next_poll = iter + DBI_DEADLINE_POLL_INTERVAL;\
+        if (monotonic_ns() >= runtime->deadline) {\
+            return deadline_exceeded(runtime, stmt->lineno, resume_lineno, resume_ip);\
+        }\
+    }\
+} while(0)
 
-#define pop_sub()\
-    callstack[callstack_offset--]
+// Line that code at ip came from, which is another line in a subroutine inlined by dbi_optimize
+static long statement_lineno_at(struct Statement *stmt, long ip)
+{
+    if (ip >= stmt->inline_start && ip < stmt->inline_end) {
+        return stmt->inline_lineno;
+    }
+    return stmt->lineno;
+}
 
 #define expect_int(in) do {\
     if (obj->type == DBI_VAR) {\
-        obj = vars[obj->bvar];\
+        obj = &vars[obj->bvar];\
     }\
     if (obj->type != DBI_INT) {\
-        runtime_error(stmt->lineno, "expected integer %s", in);\
+        runtime_error(statement_lineno_at(stmt, ip), "expected integer %s", in);\
+        return DBI_STATUS_ERROR;\
+    }\
+} while(0)
+
+// A single unsigned comparison also rejects negative indexes
+#define expect_index(var, index) do {\
+    if (!array) {\
+        runtime_error(statement_lineno_at(stmt, ip), "array %c has not been dimensioned", var + 'A');\
+        return DBI_STATUS_ERROR;\
+    } else if ((unsigned long) (index) >= (unsigned long) array->size) {\
+        runtime_error(statement_lineno_at(stmt, ip), "index %ld out of bounds for array %c", index, var + 'A');\
         return DBI_STATUS_ERROR;\
     }\
 } while(0)
 
 #define expect_string(in) do {\
     if (obj->type == DBI_VAR) {\
-        obj = vars[obj->bvar];\
+        obj = &vars[obj->bvar];\
     }\
     if (obj->type != DBI_STR) {\
-        runtime_error(stmt->lineno, "expected string %s", in);\
+        runtime_error(statement_lineno_at(stmt, ip), "expected string %s", in);\
         return DBI_STATUS_ERROR;\
     }\
 } while(0)
@@ -1615,28 +3469,38 @@ static struct Statement *execute_input(struct Statement *stmt, int var_count, ui
 static enum DbiStatus execute_line(
         struct Runtime *runtime,
         struct Statement *stmt,
+        long ip,
         struct Program *program,
         bool run_file)
 {
-    struct Statement **statements = program->statements;
-    struct DbiObject **vars = runtime->vars;
+    struct Statement **statements = runtime->version->statements;
+    struct DbiObject *vars = runtime->vars->array;
     enum DbiStatus status = DBI_STATUS_GOOD;
 
     int stack_offset = 0;
     struct DbiObject stack[DBI_MAX_STACK];
 
-    int callstack_offset = runtime->callstack_offset;
-    int *callstack = runtime->callstack;
-
     struct DbiObject *obj;
-    long ip = 0;
 
     // Forward declarations since clang doesn't like these in switch
     long mem_loc, count;
     long lnum, rnum;
     long cmp;
+    struct LoopFrame *frame;
+    struct CallFrame *call;
+    struct Array *array;
+    bool in_range;
     long iter = 0;
+    long next_poll = runtime->deadline ? DBI_DEADLINE_POLL_INTERVAL : LONG_MAX;
 
+// Must be used whenever execution moves to another statement
+#define compile_lazy(stmt)\
+    if (!statement_is_compiled(stmt)\
+            && !statement_compile_lazy(stmt, &program->registry->commands)) {\
+        return DBI_STATUS_ERROR;\
+    }
+
+    compile_lazy(stmt);
     while (true) {
         uint8_t op = stmt->bytecode->array[ip];
 
@@ -1673,7 +3537,7 @@ static enum DbiStatus execute_line(
 
         iter++;
         if (iter == DBI_MAX_ITERATIONS) {
-            runtime_error(stmt->lineno, "probable infinite loop detected");
+            runtime_error(statement_lineno_at(stmt, ip), "probable infinite loop detected");
             return DBI_STATUS_ERROR;
         }
         switch (op) {
@@ -1682,7 +3546,7 @@ static enum DbiStatus execute_line(
             case OP_PUSH:
                 mem_loc = stmt->bytecode->array[++ip];
                 if (stack_offset + 1 >= DBI_MAX_STACK) {
-                    runtime_error(stmt->lineno, "stack overflow");
+                    runtime_error(statement_lineno_at(stmt, ip), "stack overflow");
                     return DBI_STATUS_ERROR;
                 }
                 push(stmt->memory->array[mem_loc]);
@@ -1697,7 +3561,38 @@ static enum DbiStatus execute_line(
                 }
 
                 // Get new input
-                runtime->input_stmt = execute_input(stmt, count, stmt->bytecode->array + ip + 1);
+                char *provided = runtime->input_text;
+                char line[DBI_MAX_LINE_LENGTH] = {0};
+                if (provided) {
+                    runtime->input_text = NULL;
+                } else if (runtime->suspend_on_input) {
+                    // Runs INPUT again once the host has provided input
+                    runtime->lineno = stmt->lineno;
+                    runtime->ip = ip - 1;
+                    return DBI_STATUS_INPUT;
+                }
+#if DBI_DISABLE_IO
+                if (!provided) {
+                    runtime_error(stmt->lineno, "no input provided");
+                    return DBI_STATUS_ERROR;
+                }
+#else
+                runtime_flush(runtime);
+                if (!provided && !fgets(line, DBI_MAX_LINE_LENGTH, stdin)) {
+                    runtime_error(stmt->lineno, "unexpected end of input");
+                    return DBI_STATUS_ERROR;
+                }
+#endif
+                if (input_literals(runtime, provided ? provided : line, count,
+                            stmt->bytecode->array + ip + 1)) {
+                    free(provided);
+                    vars = runtime->vars->array;
+                    ip += count;
+                    break;
+                }
+                runtime->input_stmt = execute_input(stmt, count, stmt->bytecode->array + ip + 1,
+                        provided ? provided : line);
+                free(provided);
                 if (runtime->input_stmt == NULL) {
                     return DBI_STATUS_ERROR;
                 }
@@ -1709,31 +3604,34 @@ static enum DbiStatus execute_line(
             case OP_LET:
                 obj = pop();
                 mem_loc = stmt->bytecode->array[++ip];
+                vars = variables_unshare(runtime);
                 if (obj->type == DBI_VAR) {
                     if (mem_loc != obj->bvar) {
-                        bobj_copy(vars[mem_loc], vars[obj->bvar]);
+                        bobj_copy(&vars[mem_loc], &vars[obj->bvar]);
                     }
                 } else {
-                    bobj_copy(vars[mem_loc], obj);
+                    bobj_copy(&vars[mem_loc], obj);
                 }
                 break;
             case OP_JMP:
                 obj = pop();
                 if (obj->type == DBI_VAR) {
-                    obj = vars[obj->bvar];
+                    obj = &vars[obj->bvar];
                 }
                 if (obj->type != DBI_INT) {
-                    runtime_error(stmt->lineno, "cannot goto non-integer");
+                    runtime_error(statement_lineno_at(stmt, ip), "cannot goto non-integer");
                     return DBI_STATUS_ERROR;
                 } else if (obj->bint <= 0 || obj->bint >= DBI_MAX_PROG_SIZE) {
-                    runtime_error(stmt->lineno, "goto %d out of bounds", obj->bint);
+                    runtime_error(statement_lineno_at(stmt, ip), "goto %d out of bounds", obj->bint);
                     return DBI_STATUS_ERROR;
                 } else if (statements[obj->bint] == NULL) {
-                    runtime_error(stmt->lineno, "cannot goto %d, no such line", obj->bint);
+                    runtime_error(statement_lineno_at(stmt, ip), "cannot goto %d, no such line", obj->bint);
                     return DBI_STATUS_ERROR;
                 }
+                check_deadline(obj->bint, 0);
                 ip = 0;
                 stmt = statements[obj->bint];
+                compile_lazy(stmt);
                 continue;
             case OP_JNZ:
                 obj = pop();
@@ -1745,37 +3643,157 @@ static enum DbiStatus execute_line(
                 }
                 break;
             case OP_CALL:
-                if (callstack_offset + 1 >= DBI_MAX_CALL_STACK) {
-                    runtime_error(stmt->lineno, "stack overflow");
+                obj = pop();
+                if (obj->type == DBI_VAR) {
+                    obj = &vars[obj->bvar];
+                }
+                if (obj->type != DBI_INT) {
+                    runtime_error(statement_lineno_at(stmt, ip), "cannot gosub non-integer");
+                    return DBI_STATUS_ERROR;
+                } else if (obj->bint <= 0 || obj->bint >= DBI_MAX_PROG_SIZE) {
+                    runtime_error(statement_lineno_at(stmt, ip), "gosub %d out of bounds", obj->bint);
+                    return DBI_STATUS_ERROR;
+                } else if (statements[obj->bint] == NULL) {
+                    runtime_error(statement_lineno_at(stmt, ip), "cannot gosub %d, no such line", obj->bint);
                     return DBI_STATUS_ERROR;
                 }
-                obj = pop();
-                push_sub(obj->bint);
-                break;
+                call = callstack_push(runtime);
+                if (!call) {
+                    runtime_error(statement_lineno_at(stmt, ip), "stack overflow");
+                    return DBI_STATUS_ERROR;
+                }
+                call->stmt = stmt;
+                call->ip = ip;
+                check_deadline(obj->bint, 0);
+                ip = 0;
+                stmt = statements[obj->bint];
+                compile_lazy(stmt);
+                continue;
             case OP_RETURN:
-                if (callstack_offset <=  0) {
+                if (runtime->callstack_offset <= 0) {
                     // If we're not in a subroutine, this sends us back to the REPL
                     return DBI_STATUS_GOOD;
                 }
-                stmt = statement_next(statements, pop_sub());
-                if (stmt) {
-                    ip = 0;
-                    continue;
-                } 
-                return DBI_STATUS_GOOD;
+                call = &runtime->callstack[--runtime->callstack_offset];
+                check_deadline(call->stmt->lineno, call->ip + 1);
+                stmt = call->stmt;
+                ip = call->ip;
+                break;
+            case OP_FOR:
+                obj = pop();
+                expect_int("as FOR step");
+                rnum = obj->bint;
+                obj = pop();
+                expect_int("as FOR limit");
+                lnum = obj->bint;
+                mem_loc = stmt->bytecode->array[++ip];
+                if (vars[mem_loc].type != DBI_INT) {
+                    runtime_error(statement_lineno_at(stmt, ip), "expected integer as FOR start");
+                    return DBI_STATUS_ERROR;
+                }
+                // Starting a loop over a variable again ends it and any loops inside it
+                for (count = 0; count < runtime->loop_offset; count++) {
+                    if (runtime->loops[count].var == mem_loc) {
+                        runtime->loop_offset = count;
+                        break;
+                    }
+                }
+                if (runtime->loop_offset >= DBI_MAX_LOOP_STACK) {
+                    runtime_error(statement_lineno_at(stmt, ip), "too many nested FOR loops");
+                    return DBI_STATUS_ERROR;
+                }
+                frame = &runtime->loops[runtime->loop_offset++];
+                frame->stmt = stmt;
+                frame->ip = ip;
+                frame->limit = lnum;
+                frame->step = rnum;
+                frame->var = mem_loc;
+                break;
+            case OP_NEXT:
+                // Innermost loop over variable, ending any loops inside it
+                mem_loc = stmt->bytecode->array[++ip];
+                count = runtime->loop_offset;
+                while (count > 0 && mem_loc != NEXT_ANY_VAR
+                        && runtime->loops[count - 1].var != mem_loc) {
+                    count--;
+                }
+                if (count == 0) {
+                    runtime_error(statement_lineno_at(stmt, ip), "NEXT without FOR");
+                    return DBI_STATUS_ERROR;
+                }
+                runtime->loop_offset = count;
+                frame = &runtime->loops[count - 1];
+
+                vars = variables_unshare(runtime);
+                obj = &vars[frame->var];
+                if (obj->type != DBI_INT) {
+                    runtime_error(statement_lineno_at(stmt, ip), "expected integer as FOR variable");
+                    return DBI_STATUS_ERROR;
+                }
+                // Overflowing ends the loop rather than wrapping around
+                in_range = !__builtin_add_overflow(obj->bint, frame->step, &obj->bint)
+                    && (frame->step >= 0 ? obj->bint <= frame->limit : obj->bint >= frame->limit);
+                if (!in_range) {
+                    runtime->loop_offset--;
+                    break;
+                }
+                check_deadline(frame->stmt->lineno, frame->ip + 1);
+                stmt = frame->stmt;
+                ip = frame->ip;
+                break;
+            case OP_DIM:
+                obj = pop();
+                expect_int("as array size");
+                mem_loc = stmt->bytecode->array[++ip];
+                if (obj->bint < 0 || obj->bint >= DBI_MAX_ARRAY_SIZE) {
+                    runtime_error(statement_lineno_at(stmt, ip), "array size %ld out of bounds", obj->bint);
+                    return DBI_STATUS_ERROR;
+                }
+                // Dimensioning an array again replaces it with a zeroed one
+                array_release(runtime->arrays[mem_loc]);
+                runtime->arrays[mem_loc] = array_new(obj->bint + 1);
+                break;
+            case OP_AGET:
+                obj = pop();
+                expect_int("as array index");
+                lnum = obj->bint;
+                mem_loc = stmt->bytecode->array[++ip];
+                array = runtime->arrays[mem_loc];
+                expect_index(mem_loc, lnum);
+                push_int(array->data[lnum]);
+                break;
+            case OP_ASET:
+                obj = pop();
+                expect_int("in array assignment");
+                rnum = obj->bint;
+                obj = pop();
+                expect_int("as array index");
+                lnum = obj->bint;
+                mem_loc = stmt->bytecode->array[++ip];
+                array = runtime->arrays[mem_loc];
+                expect_index(mem_loc, lnum);
+                array = array_unshare(runtime, mem_loc);
+                array->data[lnum] = rnum;
+                break;
             case OP_CLEAR:
+                program_update(program, NULL, 0, true);
                 if (stmt->lineno != 0) {
                     // If statement is self-destructing, just return to REPL
-                    program_clear(statements);
                     return DBI_STATUS_GOOD;
-                } else {
-                    program_clear(statements);
                 }
+                // Rest of the line runs on the cleared program
+                runtime->callstack_offset = 0;
+                runtime->loop_offset = 0;
+                version_unpin(program, runtime->version);
+                runtime->version = version_pin(program);
+                statements = runtime->version->statements;
                 break;
             case OP_LIST:
+                runtime_flush(runtime);
                 program_list(statements);
                 break;
             case OP_LISTB:
+                runtime_flush(runtime);
                 program_listb(statements);
                 break;
             case OP_RUN:
@@ -1784,6 +3802,7 @@ static enum DbiStatus execute_line(
                     return DBI_STATUS_GOOD;
                 }
                 ip = 0;
+                compile_lazy(stmt);
                 continue;
             case OP_END:
                 if (run_file || stmt->lineno == 0) {
@@ -1799,7 +3818,7 @@ static enum DbiStatus execute_line(
                 obj = pop();
                 expect_string("argument for SAVE command");
                 if (!program_save(statements, obj->bstr)) {
-                    runtime_error(stmt->lineno, "%s", strerror(errno));
+                    runtime_error(statement_lineno_at(stmt, ip), "%s", strerror(errno));
                     return DBI_STATUS_ERROR;
                 }
                 break;
@@ -1818,7 +3837,7 @@ static enum DbiStatus execute_line(
             case OP_DIV:
                 math_boilerplate();
                 if (rnum == 0) {
-                    runtime_error(stmt->lineno, "division by zero");
+                    runtime_error(statement_lineno_at(stmt, ip), "division by zero");
                     return DBI_STATUS_ERROR;
                 }
                 push_int(lnum / rnum);
@@ -1826,7 +3845,7 @@ static enum DbiStatus execute_line(
             case OP_MOD:
                 math_boilerplate();
                 if (rnum == 0) {
-                    runtime_error(stmt->lineno, "modulus by zero");
+                    runtime_error(statement_lineno_at(stmt, ip), "modulus by zero");
                     return DBI_STATUS_ERROR;
                 }
                 push_int(lnum % rnum);
@@ -1859,34 +3878,116 @@ static enum DbiStatus execute_line(
                 assert(runtime->ffi_argc < DBI_MAX_LINE_MEMORY);
                 obj = pop();
                 if (obj->type == DBI_VAR) {
-                    bobj_copy(runtime->ffi_argv[runtime->ffi_argc], vars[obj->bvar]);
-                } else {
-                    bobj_copy(runtime->ffi_argv[runtime->ffi_argc], obj);
+                    obj = &vars[obj->bvar];
                 }
+                bobj_copy(runtime_ffi_argv(runtime)[runtime->ffi_argc], obj);
                 runtime->ffi_argc++;
                 break;
             case OP_FFI_MACRO_ARG:
                 assert(runtime->ffi_argc < DBI_MAX_LINE_MEMORY);
                 obj = pop();
-                bobj_copy(runtime->ffi_argv[runtime->ffi_argc], obj);
+                bobj_copy(runtime_ffi_argv(runtime)[runtime->ffi_argc], obj);
                 runtime->ffi_argc++;
                 break;
+            case OP_FFI_BORROW_ARG:
+                assert(runtime->ffi_argc < DBI_MAX_LINE_MEMORY);
+                obj = pop();
+                if (obj->type == DBI_VAR) {
+                    obj = &vars[obj->bvar];
+                }
+                // Stack slot is reused by the next argument, but strings are not copied
+                runtime->ffi_views[runtime->ffi_argc] = *obj;
+                runtime->ffi_view_ptrs[runtime->ffi_argc] = &runtime->ffi_views[runtime->ffi_argc];
+                runtime->ffi_argc++;
+                runtime->ffi_borrowed = true;
+                break;
+            case OP_FFI_FUNC:
+                obj = pop();
+                count = stmt->bytecode->array[++ip];
+                struct ForeignCall *func = program->registry->commands.foreign_calls[obj->bint];
+                // Arguments are used in place on the stack
+                union DbiValue func_args[DBI_MAX_STACK];
+                int bad_func_arg = ffi_typed_args(func, stack + stack_offset - count + 1, count,
+                        vars, func_args);
+                if (bad_func_arg != -1) {
+                    runtime_error(statement_lineno_at(stmt, ip), "argument %d of %s must be %s",
+                            bad_func_arg + 1, func->name,
+                            signature_type(func, bad_func_arg) == 'I' ? "an integer" : "a string");
+                    return DBI_STATUS_ERROR;
+                }
+                union DbiValue result;
+                runtime->lineno = stmt->lineno;
+                status = func->function((DbiRuntime) runtime, count, func_args, &result);
+                vars = runtime->vars->array;
+                if (status != DBI_STATUS_GOOD) {
+                    if (status != DBI_STATUS_ERROR) {
+                        runtime_error(statement_lineno_at(stmt, ip), "function %s can only succeed or fail",
+                                func->name);
+                    }
+                    return DBI_STATUS_ERROR;
+                }
+                stack_offset -= count;
+                stack_offset++;
+                stack[stack_offset].type = func->result_type;
+                if (func->result_type == DBI_INT) {
+                    stack[stack_offset].bint = result.bint;
+                } else {
+                    stack[stack_offset].bstr = (char *) result.bstr;
+                }
+                break;
             case OP_FFI_CALL:
+            case OP_FFI_TYPED_CALL:
                 obj = pop();
                 runtime->lineno = stmt->lineno;
-                DbiForeignCall call = program->foreign_call_table[obj->bint];
-                status = call((DbiRuntime) runtime);
+                struct ForeignCall *fc = program->registry->commands.foreign_calls[obj->bint];
+                if (op == OP_FFI_CALL) {
+                    status = fc->call((DbiRuntime) runtime);
+                } else {
+                    union DbiValue args[DBI_MAX_LINE_MEMORY];
+                    int bad_arg = ffi_typed_args(fc, runtime->ffi_views, runtime->ffi_argc, vars,
+                            args);
+                    if (bad_arg != -1) {
+                        runtime->ffi_argc = 0;
+                        runtime->ffi_borrowed = false;
+                        runtime_error(stmt->lineno, "argument %d of %s must be %s", bad_arg + 1,
+                                fc->name, signature_type(fc, bad_arg) == 'I' ? "an integer" : "a string");
+                        return DBI_STATUS_ERROR;
+                    }
+                    if (fc->async_call && !runtime->in_repl) {
+                        // Resumes just after the call once it has finished
+                        async_submit(runtime, fc, args);
+                        runtime->ffi_argc = 0;
+                        runtime->ffi_borrowed = false;
+                        runtime->lineno = stmt->lineno;
+                        runtime->ip = ip + 1;
+                        return DBI_STATUS_WAITING;
+                    } else if (fc->async_call) {
+                        runtime_flush(runtime);
+                        status = async_status(fc, stmt->lineno,
+                                fc->async_call(runtime->context, runtime->ffi_argc, args));
+                    } else {
+                        status = fc->typed_call((DbiRuntime) runtime, runtime->ffi_argc, args);
+                    }
+                }
                 runtime->ffi_argc = 0;
+                runtime->ffi_borrowed = false;
+                // Foreign call may have set variables
+                vars = runtime->vars->array;
                 runtime->lineno++;
                 if (status == DBI_STATUS_YIELD) {
-                    runtime->callstack_offset = callstack_offset;
+                    return status;
+                } else if (status == DBI_STATUS_WAITING) {
+                    // Command slept with dbi_runtime_sleep, so resume just after it
+                    runtime->lineno = stmt->lineno;
+                    runtime->ip = ip + 1;
                     return status;
                 } else if (status != DBI_STATUS_GOOD) {
                     return status;
                 }
+                check_deadline(stmt->lineno, ip + 1);
                 break;
             default:
-                runtime_error(stmt->lineno, "Internal error: unknown command encountered\n");
+                runtime_error(statement_lineno_at(stmt, ip), "Internal error: unknown command encountered\n");
                 return DBI_STATUS_ERROR;
         }
         ip++;
@@ -1900,47 +4001,19 @@ static enum DbiStatus execute_line(
                 break;
             }
             ip = 0;
+            compile_lazy(stmt);
         }
     }
     return status;
 }
 
-void temps_init(char *input, struct Memory *temp_memory, struct Bytecode *temp_bytecode)
-{
-    memset(input, 0, DBI_MAX_LINE_LENGTH);
-
-    temp_memory->index = 0;
-    memset(temp_memory->array, 0, sizeof(*temp_memory->array) * DBI_MAX_LINE_MEMORY);
-
-    temp_bytecode->index = 0;
-    memset(temp_bytecode->array, 0, DBI_MAX_BYTECODE);
-
-    global_lineno = -1;
-}
-
-static void foreign_call_table_init(struct Program *program)
-{
-    int count = 0;
-    struct ForeignCall *foreign_calls = program->foreign_calls;
-    while (foreign_calls != NULL) {
-        count++;
-        foreign_calls = foreign_calls->next;
-    }
-    if (count == 0) {
-        return;
-    }
-    program->foreign_call_table = calloc(count, sizeof(*program->foreign_call_table));
-    foreign_calls = program->foreign_calls;
-    for (int i = 0; i < count; i++) {
-        program->foreign_call_table[i] = foreign_calls->call;
-        foreign_calls = foreign_calls->next;
-    }
-}
+#undef compile_lazy
 
 static enum DbiStatus print_help(DbiRuntime dbi)
 {
     int argc = dbi_get_argc(dbi);
     assert(argc == 0);
+    dbi_flush(dbi);
 
     print_line();
     printf(" %-8s|  %-52s|  %-25s\n", "command", "description", "usage");
@@ -1959,7 +4032,7 @@ static enum DbiStatus print_help(DbiRuntime dbi)
         }
     }
     struct Program *program = ((struct Runtime *)dbi)->program;
-    struct ForeignCall *fc = program->foreign_calls;
+    struct ForeignCall *fc = program->registry->foreign_calls;
     while (fc) {
         printf(" %-8s|  %-52s|  %-25s\n", fc->name, fc->docstring, fc->example);
         fc = fc->next;
@@ -2004,7 +4077,6 @@ static bool repl(DbiProgram prog, char *input_file_name, void *context)
     assert(!program->has_compiled);
     dbi_register_command_with_info(prog, "HELP", print_help, 0, "you just ran this", "HELP");
 
-    foreign_call_table_init(program);
     program->has_compiled = true;
 
     char input[DBI_MAX_LINE_LENGTH];
@@ -2017,12 +4089,18 @@ static bool repl(DbiProgram prog, char *input_file_name, void *context)
 
     bool input_error = false;
 
+    // Numbered lines are published together when the next command runs, rather than one at a time
+    long pending_count = 0;
+    long pending_size = 64;
+    struct Statement **pending = malloc(pending_size * sizeof(*pending));
+
     DbiRuntime dbi = runtime_new_with_program(program);
     if (context) {
         dbi_set_context(dbi, context);
     }
 
     struct Runtime *runtime = (struct Runtime *) dbi;
+    runtime->in_repl = true;
 
     while (true) {
         temps_init(input, &temp_memory, &temp_bytecode);
@@ -2058,15 +4136,23 @@ static bool repl(DbiProgram prog, char *input_file_name, void *context)
             continue;
         }
 
-        struct Statement *stmt = compile_line(input, program->foreign_calls,
-                &temp_memory, &temp_bytecode);
+        struct Statement *stmt = compile_line(input, &program->registry->commands,
+                &temp_memory, &temp_bytecode, NULL);
         if (!stmt) {
             /* Error */
             print_errors();
             continue;
         } else if (stmt->lineno == 0) {
             /* No line number means we execute the command immediately */
-            enum DbiStatus status = execute_line(runtime, stmt, program, run_file);
+            program_update(program, pending, pending_count, false);
+            pending_count = 0;
+            runtime->version = version_pin(program);
+            enum DbiStatus status = execute_line(runtime, stmt, 0, program, run_file);
+            runtime_flush(runtime);
+            version_unpin(program, runtime->version);
+            runtime->version = NULL;
+            runtime->callstack_offset = 0;
+            runtime->loop_offset = 0;
 
             /* Clear output parameters */
             run_file = false;
@@ -2091,327 +4177,2147 @@ static bool repl(DbiProgram prog, char *input_file_name, void *context)
             } else if (status == DBI_STATUS_ERROR) {
                 print_errors();
             }
-            statement_free(stmt);
+            statement_free(stmt);
+        } else {
+            if (pending_count == pending_size) {
+                pending_size *= 2;
+                pending = realloc(pending, pending_size * sizeof(*pending));
+            }
+            pending[pending_count++] = stmt;
+        }
+    }
+    program_update(program, pending, pending_count, false);
+    free(pending);
+    if (file != stdin) {
+        fclose(file);
+    }
+    dbi_runtime_free(dbi);
+    return global_err_msg[0] == '\0';
+}
+
+bool dbi_repl(DbiProgram prog, char *input_file_name)
+{
+    return repl(prog, input_file_name, NULL);
+}
+
+bool dbi_repl_with_context(DbiProgram prog, char *input_file_name, void *context)
+{
+    return repl(prog, input_file_name, context);
+}
+
+// Lines without a line number are an error outside of the repl
+static void add_compiled_line(struct Statement **statements, struct Statement *stmt,
+        struct Statement **shared)
+{
+    if (!stmt) {
+        /* Error */
+    } else if (stmt->lineno == 0) {
+        /* No line number is an error in compile mode */
+        compile_error("statement missing line number");
+        statement_free(stmt);
+    } else {
+        statements_insert(statements, stmt, shared);
+    }
+}
+
+// Returns statement from shared table if the line at input is exactly the same as it. Commands
+// cannot be registered once a program has compiled, so the same text always compiles to the same
+// code. In eager mode, a lazy statement is compiled again so that its errors are reported now.
+static struct Statement *statement_reuse(char *input, char *end, struct Statement **shared,
+        bool lazy)
+{
+    ignore_whitespace(&input);
+    long lineno = 0;
+    for (int i = 0; isdigit(input[i]); i++) {
+        lineno = lineno * 10 + input[i] - '0';
+        if (lineno >= DBI_MAX_PROG_SIZE) {
+            return NULL;
+        }
+    }
+    struct Statement *stmt = shared[lineno];
+    if (!stmt || stmt->optimized || (!lazy && !statement_is_compiled(stmt))) {
+        return NULL;
+    }
+    // Statements keep the newline, but not anything after it
+    size_t line_len = end - input + (*end == '\n');
+    if (stmt->line_len != line_len || stmt->hash != line_hash(input, line_len)
+            || memcmp(stmt->line, input, line_len) != 0) {
+        return NULL;
+    }
+    return stmt;
+}
+
+static char *read_fd(int fd, size_t *len)
+{
+    size_t size = 4096;
+    char *text = malloc(size);
+    *len = 0;
+    ssize_t n;
+    while ((n = read(fd, text + *len, size - *len - 1)) > 0) {
+        *len += n;
+        if (*len + 1 == size) {
+            size *= 2;
+            text = realloc(text, size);
+        }
+    }
+    if (n == -1) {
+        free(text);
+        return NULL;
+    }
+    text[*len] = '\0';
+    return text;
+}
+
+// Regular files are mapped instead of read, so statements can point straight into the page cache
+static struct Source *source_open(char *file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        runtime_error(-1, "%s", strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    struct Source *source = calloc(1, sizeof(*source));
+    if (S_ISREG(st.st_mode)) {
+        // The file is mapped over the start of a zeroed mapping one byte larger, so that the
+        // text is NUL-terminated even when the file ends on a page boundary
+        source->size = st.st_size;
+        source->mapped = true;
+        char *text = mmap(NULL, source->size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (text != MAP_FAILED && source->size > 0 && mmap(text, source->size, PROT_READ,
+                    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(text, source->size + 1);
+            text = MAP_FAILED;
+        }
+        source->text = text == MAP_FAILED ? NULL : text;
+    } else {
+        source->text = read_fd(fd, &source->size);
+    }
+    if (!source->text) {
+        runtime_error(-1, "%s", strerror(errno));
+        free(source);
+        source = NULL;
+    }
+    close(fd);
+    return source;
+}
+
+static void source_free(struct Source *source)
+{
+    if (source->mapped) {
+        munmap(source->text, source->size + 1);
+    } else {
+        free(source->text);
+    }
+    free(source);
+}
+
+static void sources_free(struct Source *source)
+{
+    while (source != NULL) {
+        struct Source *next = source->next;
+        source_free(source);
+        source = next;
+    }
+}
+
+// Frees sources that no statement points into anymore
+static void sources_sweep(struct Program *program)
+{
+    struct Source **source_ptr = &program->sources;
+    while (*source_ptr != NULL) {
+        struct Source *source = *source_ptr;
+        if (source->refs == 0) {
+            *source_ptr = source->next;
+            source_free(source);
+        } else {
+            source_ptr = &source->next;
+        }
+    }
+}
+
+/*
+ * Lines are split 64 bytes at a time: each block is compared against '\n' with SIMD and the
+ * result is kept as a bitmask, so finding the next line is a count of trailing zeros rather than
+ * a loop over every character. AVX2 or SSE2 is used if the compiler targets it, otherwise the
+ * mask is built one byte at a time.
+ */
+struct Lines {
+    char *block; // Start of block described by mask
+    char *end;
+    uint64_t mask; // Newlines in block that have not been returned yet
+};
+
+static uint64_t newline_mask(char *block, char *end)
+{
+    uint64_t mask = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    if (end - block >= 64) {
+        __m256i newline = _mm256_set1_epi8('\n');
+        __m256i lo = _mm256_loadu_si256((__m256i *) block);
+        __m256i hi = _mm256_loadu_si256((__m256i *) (block + 32));
+        mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline))
+            | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)) << 32;
+        i = 64;
+    }
+#elif defined(__SSE2__)
+    if (end - block >= 64) {
+        __m128i newline = _mm_set1_epi8('\n');
+        for (; i < 64; i += 16) {
+            __m128i chunk = _mm_loadu_si128((__m128i *) (block + i));
+            mask |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)) << i;
+        }
+    }
+#endif
+    for (; i < 64 && block + i < end; i++) {
+        mask |= (uint64_t) (block[i] == '\n') << i;
+    }
+    return mask;
+}
+
+static void lines_init(struct Lines *lines, char *text, char *end)
+{
+    lines->block = text;
+    lines->end = end;
+    lines->mask = text < end ? newline_mask(text, end) : 0;
+}
+
+// Returns next newline, or end if there are no more
+static char *lines_next(struct Lines *lines)
+{
+    while (lines->mask == 0) {
+        if (lines->end - lines->block <= 64) {
+            lines->block = lines->end;
+            return lines->end;
+        }
+        lines->block += 64;
+        lines->mask = newline_mask(lines->block, lines->end);
+    }
+    char *newline = lines->block + __builtin_ctzll(lines->mask);
+    lines->mask &= lines->mask - 1;
+    return newline;
+}
+
+// Compiles lines in [line, end) of source into statements. Unchanged lines reuse the statement
+// from the shared table (if there is one) instead.
+static void compile_lines(struct CommandIndex *commands, struct Source *source, char *line,
+        char *end, struct Statement **statements, bool lazy, struct Statement **shared,
+        struct CompileStats *stats)
+{
+    struct DbiObject *temp_memory_array[DBI_MAX_LINE_MEMORY];
+    struct Memory temp_memory = { 0, temp_memory_array };
+
+    uint8_t temp_bytecode_array[DBI_MAX_BYTECODE];
+    struct Bytecode temp_bytecode = { 0, temp_bytecode_array };
+
+    struct Lines lines;
+    lines_init(&lines, line, end);
+    while (line < end) {
+        char *newline = lines_next(&lines);
+        struct Statement *stmt;
+        if (shared && (stmt = statement_reuse(line, newline, shared, lazy))) {
+            statements_insert(statements, stmt, shared);
+            stats->reused++;
+            line = newline + 1;
+            continue;
+        } else if (lazy) {
+            global_lineno = -1;
+            stmt = index_line(line, commands, source);
+        } else {
+            temps_init(NULL, &temp_memory, &temp_bytecode);
+            stmt = compile_line(line, commands, &temp_memory, &temp_bytecode, source);
+        }
+        stats->compiled += stmt != NULL;
+        add_compiled_line(statements, stmt, shared);
+        line = newline + 1;
+    }
+}
+
+/*
+ * For parallel compilation, source is split into one chunk per thread at line boundaries. Each
+ * chunk is compiled into its own statement table, with its own (thread local) error message.
+ * Tables and messages are then merged in chunk order, so later lines still replace earlier ones
+ * and errors come out in the same order as when compiling on one thread.
+ */
+#define COMPILE_MIN_CHUNK 65536 // Smallest chunk worth starting a thread for
+#define COMPILE_MAX_THREADS 64
+
+struct CompileJob {
+    struct CommandIndex *commands;
+    struct Source *source;
+    char *start;
+    char *end;
+    struct Statement **statements;
+    bool lazy;
+    struct Statement **shared;
+    struct CompileStats stats;
+    struct ErrorLog errors;
+    pthread_t thread;
+    bool started;
+};
+
+static void *compile_job_run(void *arg)
+{
+    struct CompileJob *job = arg;
+    global_error_log = &job->errors;
+    compile_lines(job->commands, job->source, job->start, job->end, job->statements,
+            job->lazy, job->shared, &job->stats);
+    global_error_log = NULL;
+    return NULL;
+}
+
+static int compile_thread_count(int threads, size_t size)
+{
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((size_t) threads > size / COMPILE_MIN_CHUNK + 1) {
+        threads = size / COMPILE_MIN_CHUNK + 1;
+    }
+    if (threads > COMPILE_MAX_THREADS) {
+        threads = COMPILE_MAX_THREADS;
+    }
+    return threads < 1 ? 1 : threads;
+}
+
+static void compile_lines_parallel(struct Program *program, struct Source *source, int threads,
+        bool lazy, struct Statement **statements, struct Statement **shared,
+        struct CompileStats *stats)
+{
+    char *end = source->text + source->size;
+    struct CompileJob *jobs = calloc(threads, sizeof(*jobs));
+    char *start = source->text;
+    for (int i = 0; i < threads; i++) {
+        char *chunk_end = end;
+        if (i + 1 < threads) {
+            chunk_end = source->text + source->size / threads * (i + 1);
+            chunk_end = chunk_end < start ? start : chunk_end;
+            char *newline = memchr(chunk_end, '\n', end - chunk_end);
+            chunk_end = newline ? newline + 1 : end;
+        }
+        jobs[i].commands = &program->registry->commands;
+        jobs[i].source = source;
+        jobs[i].start = start;
+        jobs[i].end = chunk_end;
+        jobs[i].statements = calloc(DBI_MAX_PROG_SIZE, sizeof(*jobs[i].statements));
+        jobs[i].lazy = lazy;
+        jobs[i].shared = shared;
+        start = chunk_end;
+    }
+
+    // First chunk is compiled on this thread
+    for (int i = 1; i < threads; i++) {
+        jobs[i].started = pthread_create(&jobs[i].thread, NULL, compile_job_run, &jobs[i]) == 0;
+    }
+    compile_job_run(&jobs[0]);
+    for (int i = 1; i < threads; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        } else {
+            compile_job_run(&jobs[i]);
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        // Appending one error at a time gives the same cut off point as compiling on one thread
+        char *msg = jobs[i].errors.text;
+        while (*msg != '\0') {
+            char *msg_end = strchr(msg, '\n') + 1;
+            char saved = *msg_end;
+            *msg_end = '\0';
+            append_error(msg);
+            *msg_end = saved;
+            msg = msg_end;
+        }
+        for (int lineno = 0; lineno < DBI_MAX_PROG_SIZE; lineno++) {
+            if (jobs[i].statements[lineno]) {
+                statements_insert(statements, jobs[i].statements[lineno], shared);
+            }
+        }
+        free(jobs[i].statements);
+        stats->reused += jobs[i].stats.reused;
+        stats->compiled += jobs[i].stats.compiled;
+    }
+    free(jobs);
+}
+
+// Every statement compiled from a source keeps all of its text alive. If they only use a small part
+// of it, as when an update reuses most lines, their lines are copied out so it can be freed.
+static void source_detach(struct Program *program, struct Source *source,
+        struct Statement **statements)
+{
+    size_t used = 0;
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        if (statements[i] && statements[i]->source == source) {
+            used += statements[i]->line_len;
+        }
+    }
+    if (used * 2 >= source->size) {
+        return;
+    }
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (stmt && stmt->source == source) {
+            char *line = malloc(stmt->line_len + 1);
+            memcpy(line, stmt->line, stmt->line_len);
+            line[stmt->line_len] = '\0';
+            stmt->line = line;
+            stmt->source = NULL;
+            source->refs--;
+        }
+    }
+    sources_sweep(program);
+}
+
+// Compiles source in place into a new statement table, which the caller publishes with
+// program_update_table while still holding the update lock. Lines that are the same as in the
+// current version keep their statement, unless reuse is false. Program takes ownership of source,
+// since statements point into it.
+static struct Statement **compile_source(struct Program *program, struct Source *source,
+        int threads, bool lazy, bool reuse)
+{
+    sources_sweep(program);
+    source->next = program->sources;
+    program->sources = source;
+
+    struct Statement **statements = calloc(DBI_MAX_PROG_SIZE, sizeof(*statements));
+    struct Statement **shared = reuse ? atomic_load(&program->version)->statements : NULL;
+    struct CompileStats stats = {0};
+    threads = compile_thread_count(threads, source->size);
+    if (threads == 1) {
+        compile_lines(&program->registry->commands, source, source->text, source->text + source->size,
+                statements, lazy, shared, &stats);
+    } else {
+        compile_lines_parallel(program, source, threads, lazy, statements, shared, &stats);
+    }
+    source_detach(program, source, statements);
+    program->compile_stats = stats;
+    return statements;
+}
+
+// Publishes every line compiled into a statement table, then frees the table
+static void program_update_table(struct Program *program, struct Statement **statements,
+        bool clear)
+{
+    program_update(program, statements, DBI_MAX_PROG_SIZE, clear);
+    free(statements);
+}
+
+// Commands can no longer be registered once program is frozen
+static void program_freeze(struct Program *program)
+{
+    pthread_mutex_lock(&program->update_lock);
+    program->has_compiled = true;
+    pthread_mutex_unlock(&program->update_lock);
+}
+
+static bool is_image_file(char *file_name);
+static bool image_load(struct Program *program, char *file_name);
+static bool compile_file_cached(struct Program *program, char *file_name, int threads);
+
+/*
+ * Compiles source and publishes it as one update, holding the update lock throughout so that the
+ * statements reused from the current version stay current. If atomic is set, nothing is published
+ * unless every line compiled. If clear is set, lines that are not in source are removed.
+ */
+static bool compile_update(struct Program *program, struct Source *source, int threads,
+        bool atomic, bool clear)
+{
+    pthread_mutex_lock(&program->update_lock);
+    struct Statement **statements = compile_source(program, source, threads,
+            program->lazy_compile, true);
+    bool ret = global_err_msg[0] == '\0';
+    if (ret || !atomic) {
+        program_update_table(program, statements, clear);
+    } else {
+        statements_free(statements, atomic_load(&program->version)->statements);
+    }
+    pthread_mutex_unlock(&program->update_lock);
+    return ret;
+}
+
+static bool compile_file(DbiProgram prog, char *input_file_name, int threads)
+{
+    if (!prog) {
+        compile_error("empty program");
+        return false;
+    }
+    memset(global_err_msg, 0, DBI_MAX_ERROR);
+    struct Program *program = (struct Program *) prog;
+    program_freeze(program);
+
+    if (is_image_file(input_file_name)) {
+        return image_load(program, input_file_name);
+    } else if (program->cache_dir) {
+        return compile_file_cached(program, input_file_name, threads);
+    }
+    struct Source *source = source_open(input_file_name);
+    if (!source) {
+        return false;
+    }
+    return compile_update(program, source, threads, false, false);
+}
+
+// Text is copied once, then compiled in place like a file
+static bool compile_text(DbiProgram prog, char *text, int threads, bool atomic, bool clear)
+{
+    if (!prog) {
+        compile_error("empty program");
+        return false;
+    }
+    memset(global_err_msg, 0, DBI_MAX_ERROR);
+    struct Program *program = (struct Program *) prog;
+    program_freeze(program);
+
+    struct Source *source = calloc(1, sizeof(*source));
+    source->size = strlen(text);
+    source->text = malloc(source->size + 1);
+    memcpy(source->text, text, source->size + 1);
+    return compile_update(program, source, threads, atomic, clear);
+}
+
+bool dbi_update_string(DbiProgram prog, char *text)
+{
+    return compile_text(prog, text, 1, true, false);
+}
+
+bool dbi_reload_string(DbiProgram prog, char *text)
+{
+    return compile_text(prog, text, 1, true, true);
+}
+
+void dbi_get_compile_stats(DbiProgram prog, long *reused, long *compiled)
+{
+    struct Program *program = (struct Program *) prog;
+    pthread_mutex_lock(&program->update_lock);
+    *reused = program->compile_stats.reused;
+    *compiled = program->compile_stats.compiled;
+    pthread_mutex_unlock(&program->update_lock);
+}
+
+// Only compile - disallow non-numbered commands
+bool dbi_compile_file(DbiProgram prog, char *input_file_name)
+{
+    return compile_file(prog, input_file_name, 1);
+}
+
+bool dbi_compile_string(DbiProgram prog, char *text)
+{
+    return compile_text(prog, text, 1, false, false);
+}
+
+void dbi_set_lazy_compile(DbiProgram prog, bool lazy)
+{
+    struct Program *program = (struct Program *) prog;
+    program->lazy_compile = lazy;
+}
+
+bool dbi_compile_file_parallel(DbiProgram prog, char *input_file_name, int threads)
+{
+    return compile_file(prog, input_file_name, threads);
+}
+
+bool dbi_compile_string_parallel(DbiProgram prog, char *text, int threads)
+{
+    return compile_text(prog, text, threads, false, false);
+}
+
+struct ForeignCall *register_command(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example, bool is_macro, bool borrows_args)
+{
+    assert(argc >= -1);
+    struct Program *program = (struct Program *) prog;
+    assert(!program->has_compiled);
+    assert(!program->registry->is_shared);
+    struct ForeignCall *fc = malloc(sizeof(*fc));
+    fc->is_macro = is_macro;
+    fc->borrows_args = borrows_args;
+    fc->argc = argc;
+    fc->name = name;
+    fc->docstring = docstring;
+    fc->example = example;
+    // Commands must be all caps, no other letters
+    while (*name != '\0') {
+        if (!(*name >= 'A' && *name <= 'Z')) {
+            printf("Improper usage: command name must be uppercase, letters A-Z\n");
+            assert(false);
+        }
+        name++;
+    }
+    fc->call = call;
+    fc->signature = NULL;
+    fc->signature_len = 0;
+    fc->typed_call = NULL;
+    fc->async_call = NULL;
+    fc->function = NULL;
+    fc->result_type = DBI_INT;
+    fc->next = NULL;
+    struct CommandIndex *commands = &program->registry->commands;
+    fc->extended_command_code = LAST_COMMAND + commands->foreign_call_count + 1;
+    if (commands->foreign_call_count == 0) {
+        program->registry->foreign_calls = fc;
+    } else {
+        commands->foreign_calls[commands->foreign_call_count - 1]->next = fc;
+    }
+    // Names must be unique
+    bool added = command_index_add(commands, fc->name, fc->extended_command_code, fc);
+    assert(added);
+    IGNORE(added);
+    return fc;
+}
+
+void dbi_register_command(DbiProgram prog, char *name, DbiForeignCall call, int argc)
+{
+    register_command(prog, name, call, argc, NULL, NULL, false, false);
+}
+
+void dbi_register_command_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example)
+{
+    register_command(prog, name, call, argc, docstring, example, false, false);
+}
+
+void dbi_register_borrowing_command(DbiProgram prog, char *name, DbiForeignCall call, int argc)
+{
+    register_command(prog, name, call, argc, NULL, NULL, false, true);
+}
+
+void dbi_register_borrowing_command_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example)
+{
+    register_command(prog, name, call, argc, docstring, example, false, true);
+}
+
+static struct ForeignCall *register_typed_command(DbiProgram prog, char *name, DbiTypedCall call, char *signature, char *docstring, char *example)
+{
+    // Signature must be types I or S, optionally followed by a '*'
+    int len = strlen(signature);
+    bool variadic = len > 0 && signature[len - 1] == '*';
+    for (int i = 0; i < len - variadic; i++) {
+        if (signature[i] != 'I' && signature[i] != 'S') {
+            printf("Improper usage: signature must only contain types I and S, and end with an optional '*'\n");
+            assert(false);
+        }
+    }
+    assert(!variadic || len > 1);
+    struct ForeignCall *fc = register_command(prog, name, NULL, variadic ? -1 : len, docstring,
+            example, false, true);
+    fc->signature = signature;
+    fc->signature_len = len - variadic;
+    fc->typed_call = call;
+    return fc;
+}
+
+static void register_function(DbiProgram prog, char *name, DbiFunction call, char *signature, enum DbiType result_type, char *docstring, char *example)
+{
+    // Single letter followed by '(' is an array
+    assert(strlen(name) > 1);
+    assert(result_type == DBI_INT || result_type == DBI_STR);
+    struct ForeignCall *fc = register_typed_command(prog, name, NULL, signature, docstring, example);
+    fc->function = call;
+    fc->result_type = result_type;
+}
+
+void dbi_register_function(DbiProgram prog, char *name, DbiFunction call, char *signature, enum DbiType result_type)
+{
+    register_function(prog, name, call, signature, result_type, NULL, NULL);
+}
+
+void dbi_register_function_with_info(DbiProgram prog, char *name, DbiFunction call, char *signature, enum DbiType result_type, char *docstring, char *example)
+{
+    register_function(prog, name, call, signature, result_type, docstring, example);
+}
+
+void dbi_register_typed_command(DbiProgram prog, char *name, DbiTypedCall call, char *signature)
+{
+    register_typed_command(prog, name, call, signature, NULL, NULL);
+}
+
+void dbi_register_typed_command_with_info(DbiProgram prog, char *name, DbiTypedCall call, char *signature, char *docstring, char *example)
+{
+    register_typed_command(prog, name, call, signature, docstring, example);
+}
+
+void dbi_register_async_command(DbiProgram prog, char *name, DbiAsyncCall call, char *signature)
+{
+    struct ForeignCall *fc = register_typed_command(prog, name, NULL, signature, NULL, NULL);
+    fc->async_call = call;
+}
+
+void dbi_register_async_command_with_info(DbiProgram prog, char *name, DbiAsyncCall call, char *signature, char *docstring, char *example)
+{
+    struct ForeignCall *fc = register_typed_command(prog, name, NULL, signature, docstring,
+            example);
+    fc->async_call = call;
+}
+
+void dbi_register_macro(DbiProgram prog, char *name, DbiForeignCall call, int argc)
+{
+    register_command(prog, name, call, argc, NULL, NULL, true, false);
+}
+
+void dbi_register_macro_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example)
+{
+    register_command(prog, name, call, argc, docstring, example, true, false);
+}
+
+// Executes program in runtime
+enum DbiStatus dbi_run(DbiRuntime dbi, DbiProgram prog)
+{
+    memset(global_err_msg, 0, DBI_MAX_ERROR);
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    struct Program *program = (struct Program *) prog;
+    if (runtime->async_job) {
+        struct ForeignCall *fc = runtime->async_job->fc;
+        enum DbiStatus status;
+        if (!async_finish(runtime, &status)) {
+            return DBI_STATUS_WAITING;
+        } else if (async_status(fc, runtime->lineno, status) != DBI_STATUS_GOOD) {
+            dbi_runtime_reset(runtime);
+            return DBI_STATUS_ERROR;
+        }
+    }
+    if (runtime->wake_ms) {
+        if (monotonic_ms() < runtime->wake_ms) {
+            return DBI_STATUS_WAITING;
+        }
+        timers_remove(runtime);
+        runtime->wake_ms = 0;
+    }
+    // A suspended runtime resumes on the version it started on
+    struct Statement **statements = runtime_pin(runtime, program)->statements;
+    struct Statement *stmt;
+    long ip = runtime->ip;
+    runtime->ip = 0;
+    if (ip > 0) {
+        // Resume partway through line
+        stmt = statements[runtime->lineno];
+        if (stmt && !statement_is_compiled(stmt)
+                && !statement_compile_lazy(stmt, &program->registry->commands)) {
+            dbi_runtime_reset(runtime);
+            return DBI_STATUS_ERROR;
+        }
+        if (stmt && ip >= stmt->bytecode->index) {
+            stmt = statement_next(statements, runtime->lineno + 1);
+            ip = 0;
+        }
+    } else {
+        stmt = statement_next(statements, runtime->lineno);
+    }
+    if (!stmt) {
+        dbi_runtime_reset(runtime);
+        return DBI_STATUS_FINISHED;
+    }
+    enum DbiStatus status = execute_line(runtime, stmt, ip, program, true);
+    runtime_flush(runtime);
+    if (status == DBI_STATUS_YIELD || status == DBI_STATUS_TIMEOUT
+            || status == DBI_STATUS_WAITING || status == DBI_STATUS_INPUT) {
+        return status;
+    } else {
+        dbi_runtime_reset(runtime);
+        return status;
+    }
+}
+
+enum DbiStatus dbi_run_with_deadline(DbiRuntime dbi, DbiProgram prog, long timeout_us)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    runtime->deadline = monotonic_ns() + (int64_t) timeout_us * 1000;
+    enum DbiStatus status = dbi_run(dbi, prog);
+    runtime->deadline = 0;
+    return status;
+}
+
+long dbi_get_lineno(DbiRuntime dbi)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    return runtime->lineno;
+}
+
+int dbi_get_argc(DbiRuntime dbi)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    return runtime->ffi_argc;
+}
+
+struct DbiObject **dbi_get_argv(DbiRuntime dbi)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    if (runtime->ffi_borrowed) {
+        return runtime->ffi_view_ptrs;
+    }
+    return runtime_ffi_argv(runtime);
+}
+
+void dbi_set_suspend_on_input(DbiRuntime dbi, bool suspend)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    runtime->suspend_on_input = suspend;
+}
+
+void dbi_provide_input(DbiRuntime dbi, const char *buf, size_t len)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    free(runtime->input_text);
+    runtime->input_text = malloc(len + 1);
+    memcpy(runtime->input_text, buf, len);
+    runtime->input_text[len] = '\0';
+}
+
+// Context can be used to pass data between C and dbi in foreign calls
+void dbi_set_context(DbiRuntime dbi, void *context)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    runtime->context = context;
+}
+
+void *dbi_get_context(DbiRuntime dbi)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    return runtime->context;
+}
+
+// Get / set object associated with var
+struct DbiObject *dbi_get_var(DbiRuntime dbi, char var)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'));
+    int offset = var >= 'a' ? 'a' : 'A';
+    // Caller may modify the returned object
+    return &variables_unshare(runtime)[var - offset];
+}
+
+void dbi_set_var(DbiRuntime dbi, char var, struct DbiObject *obj)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'));
+    assert(obj);
+    if (obj->type == DBI_VAR) {
+        obj = dbi_get_var(dbi, obj->bvar);
+    }
+    assert(obj->type != DBI_VAR);
+    int offset = var >= 'a' ? 'a' : 'A';
+    struct DbiObject *varobj = &variables_unshare(runtime)[var - offset];
+    if (varobj->type == DBI_STR && varobj->bstr != NULL) {
+        free(varobj->bstr);
+    }
+    if (obj->type == DBI_STR) {
+        varobj->type = DBI_STR;
+        varobj->bstr = obj->bstr ? strdup(obj->bstr) : NULL;
+    } else {
+        varobj->type = DBI_INT;
+        varobj->bint = obj->bint;
+    }
+}
+
+long *dbi_get_array(DbiRuntime dbi, char var, long *size)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'));
+    int offset = var >= 'a' ? 'a' : 'A';
+    if (!runtime->arrays[var - offset]) {
+        *size = 0;
+        return NULL;
+    }
+    // Caller may modify the returned elements
+    struct Array *array = array_unshare(runtime, var - offset);
+    *size = array->size;
+    return array->data;
+}
+
+long *dbi_dim_array(DbiRuntime dbi, char var, long size)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'));
+    assert(size > 0 && size <= DBI_MAX_ARRAY_SIZE);
+    int offset = var >= 'a' ? 'a' : 'A';
+    array_release(runtime->arrays[var - offset]);
+    runtime->arrays[var - offset] = array_new(size);
+    return runtime->arrays[var - offset]->data;
+}
+
+char *dbi_get_line(DbiProgram prog, long lineno)
+{
+    assert(lineno > 0);
+    assert(lineno < DBI_MAX_PROG_SIZE);
+    struct Program *program = (struct Program *) prog;
+    struct Version *version = version_pin(program);
+    struct Statement *stmt = version->statements[lineno];
+    if (!stmt) {
+        version_unpin(program, version);
+        return NULL;
+    }
+    program->line_buf = realloc(program->line_buf, stmt->line_len + 1);
+    memcpy(program->line_buf, stmt->line, stmt->line_len);
+    program->line_buf[stmt->line_len] = '\0';
+    version_unpin(program, version);
+    return program->line_buf;
+}
+
+void dbi_print_compiled(DbiProgram prog)
+{
+    struct Program *program = (struct Program *) prog;
+    assert(program->has_compiled);
+    struct Version *version = version_pin(program);
+    program_compile_lazy(version->statements, &program->registry->commands);
+    program_listb(version->statements);
+    version_unpin(program, version);
+}
+
+// *******************************************************************
+// ***************************** Optimizer *************************** 
+// *******************************************************************
+
+/*
+ * dbi_optimize rewrites the compiled program using what is known about all of its lines at once:
+ *
+ * - a GOTO / GOSUB to a line that only does GOTO goes straight to where that chain of jumps ends
+ * - GOSUB followed by RETURN becomes GOTO, so the subroutine returns straight to the caller's caller
+ * - a subroutine on a single line that only does arithmetic and assignment, and that is only ever
+ *   reached by GOSUB's with a literal line number, is copied into the first GOSUB on each line
+ *   that calls it
+ * - lines that can never run have their code dropped. They keep their text, and are compiled
+ *   again like lazily compiled lines if they ever do run.
+ *
+ * If any GOTO / GOSUB computes its line number when it runs, it could go anywhere, so no line is
+ * treated as unreachable or as only reached by GOSUB.
+ *
+ * Statements are shared with older versions of the program, which may have different lines, so
+ * rewritten lines are copies that are published as one update.
+ */
+
+#define INLINE_MAX_BYTECODE 16 // Largest subroutine (excluding RETURN) that is inlined
+#define THREAD_MAX_JUMPS 64 // Longest chain of jumps that is followed
+
+// Copy of compiled statement that the optimizer can rewrite. Memory and bytecode have room to
+// grow up to the per-line limits.
+static struct Statement *statement_copy(struct Statement *stmt)
+{
+    struct Statement *copy = statement_new(stmt->lineno, stmt->line, stmt->line_len,
+            stmt->source, NULL, NULL);
+    copy->memory = malloc(sizeof(*copy->memory));
+    copy->memory->index = stmt->memory->index;
+    copy->memory->array = malloc(DBI_MAX_LINE_MEMORY * sizeof(*copy->memory->array));
+    for (int i = 0; i < stmt->memory->index; i++) {
+        copy->memory->array[i] = bobj_dup(stmt->memory->array[i]);
+    }
+    copy->bytecode = malloc(sizeof(*copy->bytecode));
+    copy->bytecode->index = stmt->bytecode->index;
+    copy->bytecode->array = malloc(DBI_MAX_BYTECODE);
+    memcpy(copy->bytecode->array, stmt->bytecode->array, stmt->bytecode->index);
+    copy->optimized = true;
+    copy->inline_start = stmt->inline_start;
+    copy->inline_end = stmt->inline_end;
+    copy->inline_lineno = stmt->inline_lineno;
+    atomic_store(&copy->compile_state, STATEMENT_COMPILED);
+    return copy;
+}
+
+// Returns line from table that can be rewritten, copying it if it is still the original
+static struct Statement *optimizer_rewrite(struct Statement **statements,
+        struct Statement **original, long lineno)
+{
+    if (statements[lineno] == original[lineno]) {
+        statements[lineno] = statement_copy(original[lineno]);
+    }
+    return statements[lineno];
+}
+
+// Gets line number that the GOTO / GOSUB at ip jumps to, if it is a literal pushed by the
+// instruction before it at prev. Otherwise the line number is only known when it runs.
+static bool jump_target(struct Statement *stmt, int prev, int ip, long *target)
+{
+    uint8_t *code = stmt->bytecode->array;
+    if ((code[ip] != OP_JMP && code[ip] != OP_CALL) || prev < 0 || code[prev] != OP_PUSH) {
+        return false;
+    }
+    struct DbiObject *obj = stmt->memory->array[code[prev + 1]];
+    *target = obj->bint;
+    return obj->type == DBI_INT;
+}
+
+static bool jump_target_exists(struct Statement **statements, long target)
+{
+    return target > 0 && target < DBI_MAX_PROG_SIZE && statements[target] != NULL;
+}
+
+// Line that only does GOTO a literal line number
+static bool line_is_trampoline(struct Statement *stmt, long *target)
+{
+    return stmt->bytecode->index == 3 && stmt->bytecode->array[0] == OP_PUSH
+        && jump_target(stmt, 0, 2, target);
+}
+
+// Whether running line may continue on the next line, i.e. it doesn't end with an unconditional
+// GOTO, RETURN or END. Every conditional jump within a line is forward, so it still reaches the
+// last instruction.
+static bool line_falls_through(struct Statement *stmt)
+{
+    int last = -1;
+    uint8_t *code = stmt->bytecode->array;
+    for (int ip = 0; ip < stmt->bytecode->index; ip += op_length(code + ip)) {
+        last = ip;
+    }
+    return last == -1 || (code[last] != OP_JMP && code[last] != OP_RETURN && code[last] != OP_END);
+}
+
+static bool program_has_computed_jumps(struct Statement **statements)
+{
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt) {
+            continue;
+        }
+        uint8_t *code = stmt->bytecode->array;
+        long target;
+        for (int ip = 0, prev = -1; ip < stmt->bytecode->index;
+                prev = ip, ip += op_length(code + ip)) {
+            if ((code[ip] == OP_JMP || code[ip] == OP_CALL) && !jump_target(stmt, prev, ip, &target)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Points every literal GOTO / GOSUB past lines that only GOTO another line
+static void optimize_jump_threading(struct Statement **statements, struct Statement **original)
+{
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt) {
+            continue;
+        }
+        uint8_t *code = stmt->bytecode->array;
+        for (int ip = 0, prev = -1; ip < stmt->bytecode->index;
+                prev = ip, ip += op_length(code + ip)) {
+            long target, next;
+            if (!jump_target(stmt, prev, ip, &target) || !jump_target_exists(statements, target)) {
+                continue;
+            }
+            long final = target;
+            for (int jumps = 0; jumps < THREAD_MAX_JUMPS
+                    && line_is_trampoline(statements[final], &next)
+                    && jump_target_exists(statements, next) && next != final; jumps++) {
+                final = next;
+            }
+            if (final != target) {
+                stmt = optimizer_rewrite(statements, original, i);
+                code = stmt->bytecode->array;
+                stmt->memory->array[code[prev + 1]]->bint = final;
+            }
+        }
+    }
+}
+
+// Instruction that runs after ip, skipping no-ops and continuing onto the next line
+static uint8_t next_instruction(struct Statement **statements, struct Statement *stmt, int ip)
+{
+    ip += op_length(stmt->bytecode->array + ip);
+    while (true) {
+        for (; ip < stmt->bytecode->index; ip++) {
+            if (stmt->bytecode->array[ip] != OP_NO) {
+                return stmt->bytecode->array[ip];
+            }
+        }
+        stmt = statement_next(statements, stmt->lineno + 1);
+        if (!stmt) {
+            return OP_END;
+        }
+        ip = 0;
+    }
+}
+
+// GOSUB followed by RETURN becomes GOTO. The subroutine's RETURN then goes straight back to
+// where the caller would have returned to.
+static void optimize_tail_calls(struct Statement **statements, struct Statement **original)
+{
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt) {
+            continue;
+        }
+        uint8_t *code = stmt->bytecode->array;
+        for (int ip = 0; ip < stmt->bytecode->index; ip += op_length(code + ip)) {
+            if (code[ip] == OP_CALL && next_instruction(statements, stmt, ip) == OP_RETURN) {
+                stmt = optimizer_rewrite(statements, original, i);
+                code = stmt->bytecode->array;
+                code[ip] = OP_JMP;
+            }
+        }
+    }
+}
+
+// Whether line is a subroutine that can be inlined: a short run of arithmetic and assignments
+// that ends with RETURN
+static bool line_is_inlinable(struct Statement *stmt)
+{
+    uint8_t *code = stmt->bytecode->array;
+    int len = stmt->bytecode->index;
+    if (len < 1 || len - 1 > INLINE_MAX_BYTECODE || code[len - 1] != OP_RETURN
+            || stmt->inline_end != 0) {
+        return false;
+    }
+    int ip = 0;
+    while (ip < len - 1) {
+        switch (code[ip]) {
+            case OP_NO:
+            case OP_PUSH:
+            case OP_LET:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_DIM:
+            case OP_AGET:
+            case OP_ASET:
+                ip += op_length(code + ip);
+                break;
+            default:
+                return false;
+        }
+    }
+    // Last instruction is RETURN, not the argument of another instruction
+    return ip == len - 1;
+}
+
+// Replaces `PUSH line; CALL` at prev in stmt with the body of subroutine sub
+static bool inline_call(struct Statement *stmt, int prev, struct Statement *sub)
+{
+    uint8_t *code = stmt->bytecode->array;
+    int call = prev + 2;
+    int body_len = sub->bytecode->index - 1;
+    int delta = body_len - 3;
+    if (stmt->bytecode->index + delta > DBI_MAX_BYTECODE
+            || stmt->memory->index + sub->memory->index > DBI_MAX_LINE_MEMORY) {
+        return false;
+    }
+
+    // IF's jump to an absolute position, which moves if it is after the call
+    for (int ip = 0, last = -1; ip < stmt->bytecode->index; last = ip, ip += op_length(code + ip)) {
+        if (code[ip] == OP_JNZ && last >= 0 && code[last] == OP_PUSH) {
+            struct DbiObject *obj = stmt->memory->array[code[last + 1]];
+            if (obj->bint > call) {
+                obj->bint += delta;
+            }
+        }
+    }
+
+    int memory_offset = stmt->memory->index;
+    for (int i = 0; i < sub->memory->index; i++) {
+        stmt->memory->array[stmt->memory->index++] = bobj_dup(sub->memory->array[i]);
+    }
+    memmove(code + call + 1 + delta, code + call + 1, stmt->bytecode->index - call - 1);
+    memcpy(code + prev, sub->bytecode->array, body_len);
+    for (int ip = prev; ip < prev + body_len; ip += op_length(code + ip)) {
+        if (code[ip] == OP_PUSH) {
+            code[ip + 1] += memory_offset;
+        }
+    }
+    stmt->bytecode->index += delta;
+    stmt->inline_start = prev;
+    stmt->inline_end = prev + body_len;
+    stmt->inline_lineno = sub->lineno;
+    return true;
+}
+
+// Inlines subroutines that are only ever reached by literal GOSUB's
+static void optimize_inline(struct Statement **statements, struct Statement **original)
+{
+    // Number of literal GOSUB's and GOTO's to each line
+    int *gosubs = calloc(DBI_MAX_PROG_SIZE, sizeof(*gosubs));
+    int *gotos = calloc(DBI_MAX_PROG_SIZE, sizeof(*gotos));
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt) {
+            continue;
+        }
+        uint8_t *code = stmt->bytecode->array;
+        long target;
+        for (int ip = 0, prev = -1; ip < stmt->bytecode->index;
+                prev = ip, ip += op_length(code + ip)) {
+            if (jump_target(stmt, prev, ip, &target) && jump_target_exists(statements, target)) {
+                (code[ip] == OP_CALL ? gosubs : gotos)[target]++;
+            }
+        }
+    }
+
+    // Subroutine can't be the first line or be run by the line before it
+    bool *inlinable = calloc(DBI_MAX_PROG_SIZE, sizeof(*inlinable));
+    struct Statement *prev_stmt = NULL;
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt) {
+            continue;
+        }
+        inlinable[i] = gosubs[i] > 0 && gotos[i] == 0 && prev_stmt
+            && !line_falls_through(prev_stmt) && line_is_inlinable(stmt);
+        prev_stmt = stmt;
+    }
+
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt || stmt->inline_end != 0) {
+            continue;
+        }
+        uint8_t *code = stmt->bytecode->array;
+        long target;
+        for (int ip = 0, prev = -1; ip < stmt->bytecode->index;
+                prev = ip, ip += op_length(code + ip)) {
+            if (code[ip] == OP_CALL && jump_target(stmt, prev, ip, &target)
+                    && jump_target_exists(statements, target) && inlinable[target]
+                    && target != i) {
+                // Only one subroutine is inlined per line, so errors can be mapped back to it
+                struct Statement *copy = optimizer_rewrite(statements, original, i);
+                if (!inline_call(copy, prev, statements[target]) && copy != stmt) {
+                    statement_free(copy);
+                    statements[i] = stmt;
+                }
+                break;
+            }
+        }
+    }
+    free(gosubs);
+    free(gotos);
+    free(inlinable);
+}
+
+// Drops code of lines that can't be reached from the first line
+static void optimize_unreachable(struct Statement **statements, struct Statement **original)
+{
+    bool *reachable = calloc(DBI_MAX_PROG_SIZE, sizeof(*reachable));
+    long *pending = malloc(DBI_MAX_PROG_SIZE * sizeof(*pending));
+    long pending_count = 0;
+    struct Statement *first = statement_next(statements, 1);
+    if (first) {
+        reachable[first->lineno] = true;
+        pending[pending_count++] = first->lineno;
+    }
+    while (pending_count > 0) {
+        struct Statement *stmt = statements[pending[--pending_count]];
+        uint8_t *code = stmt->bytecode->array;
+        long target;
+        for (int ip = 0, prev = -1; ip < stmt->bytecode->index;
+                prev = ip, ip += op_length(code + ip)) {
+            if (jump_target(stmt, prev, ip, &target) && jump_target_exists(statements, target)
+                    && !reachable[target]) {
+                reachable[target] = true;
+                pending[pending_count++] = target;
+            }
+        }
+        struct Statement *next = statement_next(statements, stmt->lineno + 1);
+        if (next && line_falls_through(stmt) && !reachable[next->lineno]) {
+            reachable[next->lineno] = true;
+            pending[pending_count++] = next->lineno;
+        }
+    }
+
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (stmt && !reachable[i]) {
+            statements[i] = statement_new(stmt->lineno, stmt->line, stmt->line_len,
+                    stmt->source, NULL, NULL);
+            if (stmt != original[i]) {
+                statement_free(stmt);
+            }
+        }
+    }
+    free(reachable);
+    free(pending);
+}
+
+bool dbi_optimize(DbiProgram prog)
+{
+    struct Program *program = (struct Program *) prog;
+    memset(global_err_msg, 0, DBI_MAX_ERROR);
+    program_freeze(program);
+
+    // Current version can't be reclaimed while the update lock is held
+    pthread_mutex_lock(&program->update_lock);
+    struct Statement **original = atomic_load(&program->version)->statements;
+    if (!program_compile_lazy(original, &program->registry->commands)) {
+        pthread_mutex_unlock(&program->update_lock);
+        return false;
+    }
+    struct Statement **statements = malloc(DBI_MAX_PROG_SIZE * sizeof(*statements));
+    memcpy(statements, original, DBI_MAX_PROG_SIZE * sizeof(*statements));
+
+    bool computed_jumps = program_has_computed_jumps(statements);
+    optimize_jump_threading(statements, original);
+    optimize_tail_calls(statements, original);
+    if (!computed_jumps) {
+        optimize_inline(statements, original);
+        optimize_unreachable(statements, original);
+    }
+
+    // Only rewritten lines are published
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        if (statements[i] == original[i]) {
+            statements[i] = NULL;
+        }
+    }
+    program_publish(program, statements, DBI_MAX_PROG_SIZE, false, true);
+    free(statements);
+    pthread_mutex_unlock(&program->update_lock);
+    return true;
+}
+
+// *******************************************************************
+// ***************************** Snapshots *************************** 
+// *******************************************************************
+
+#define SNAPSHOT_MAGIC "DBIS"
+#define SNAPSHOT_VERSION 4
+
+// Output buffer that keeps counting bytes once it is full, so the caller can find out how
+// large the buffer needs to be. If `grow` is set, the buffer is reallocated instead.
+struct Writer {
+    uint8_t *data;
+    size_t size;
+    size_t len;
+    bool grow;
+};
+
+struct Reader {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    bool error;
+};
+
+static void put_bytes(struct Writer *writer, const void *bytes, size_t len)
+{
+    if (writer->grow && writer->len + len > writer->size) {
+        writer->size = (writer->len + len) * 2;
+        writer->data = realloc(writer->data, writer->size);
+    }
+    if (writer->len + len <= writer->size) {
+        memcpy(writer->data + writer->len, bytes, len);
+    }
+    writer->len += len;
+}
+
+// Integers are always written little endian
+static void put_uint(struct Writer *writer, uint64_t value, int width)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < width; i++) {
+        bytes[i] = (value >> (8 * i)) & 0xff;
+    }
+    put_bytes(writer, bytes, width);
+}
+
+static const uint8_t *get_bytes(struct Reader *reader, size_t len)
+{
+    if (reader->error || reader->size - reader->pos < len) {
+        reader->error = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->data + reader->pos;
+    reader->pos += len;
+    return bytes;
+}
+
+static uint64_t get_uint(struct Reader *reader, int width)
+{
+    const uint8_t *bytes = get_bytes(reader, width);
+    if (!bytes) {
+        return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < width; i++) {
+        value |= (uint64_t) bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+#define FNV_OFFSET UINT64_C(14695981039346656037)
+#define FNV_PRIME  UINT64_C(1099511628211)
+
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len)
+{
+    const uint8_t *data = bytes;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t version_hash(struct Version *version)
+{
+    uint64_t hash = atomic_load_explicit(&version->hash, memory_order_relaxed);
+    if (hash != 0) {
+        return hash;
+    }
+    hash = FNV_OFFSET;
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = version->statements[i];
+        if (stmt) {
+            // Trailing newline depends on whether line came from a file or a string
+            size_t len = stmt->line_len;
+            while (len > 0 && isspace(stmt->line[len - 1])) len--;
+            hash = hash_bytes(hash, stmt->line, len);
+            hash = hash_bytes(hash, "\n", 1);
+            // Optimized line runs different code than its text compiles to
+            if (stmt->optimized) {
+                hash = hash_bytes(hash, stmt->bytecode->array, stmt->bytecode->index);
+            }
+        }
+    }
+    hash = hash != 0 ? hash : 1;
+    atomic_store_explicit(&version->hash, hash, memory_order_relaxed);
+    return hash;
+}
+
+
+
+// Note: runtime->input_stmt is not saved, since it is only used while an INPUT statement is
+//       executing and never outlives a call to dbi_run.
+size_t dbi_runtime_save(DbiRuntime dbi, DbiProgram prog, void *buf, size_t size)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    assert(!runtime->async_job);
+    struct Program *program = (struct Program *) prog;
+    struct Writer writer = { buf, size, 0, false };
+
+    put_bytes(&writer, SNAPSHOT_MAGIC, 4);
+    put_uint(&writer, SNAPSHOT_VERSION, 1);
+    // Snapshot is of the version runtime is running, or the current version if it is not running
+    uint64_t hash;
+    if (runtime->version && runtime->program == program) {
+        hash = version_hash(runtime->version);
+    } else {
+        struct Version *version = version_pin(program);
+        hash = version_hash(version);
+        version_unpin(program, version);
+    }
+    put_uint(&writer, hash, 8);
+    put_uint(&writer, runtime->lineno, 4);
+    put_uint(&writer, runtime->ip, 4);
+
+    put_uint(&writer, runtime->callstack_offset, 4);
+    for (int i = 0; i < runtime->callstack_offset; i++) {
+        put_uint(&writer, runtime->callstack[i].stmt->lineno, 4);
+        put_uint(&writer, runtime->callstack[i].ip, 4);
+    }
+
+    put_uint(&writer, runtime->loop_offset, 4);
+    for (int i = 0; i < runtime->loop_offset; i++) {
+        struct LoopFrame *frame = &runtime->loops[i];
+        put_uint(&writer, frame->stmt->lineno, 4);
+        put_uint(&writer, frame->ip, 4);
+        put_uint(&writer, frame->var, 1);
+        put_uint(&writer, frame->limit, 8);
+        put_uint(&writer, frame->step, 8);
+    }
+
+    struct DbiObject *vars = runtime->vars->array;
+    for (int i = 0; i < DBI_MAX_VARS; i++) {
+        put_uint(&writer, vars[i].type, 1);
+        if (vars[i].type == DBI_STR) {
+            size_t len = vars[i].bstr ? strlen(vars[i].bstr) : 0;
+            put_uint(&writer, len, 4);
+            put_bytes(&writer, vars[i].bstr, len);
+        } else {
+            put_uint(&writer, vars[i].bint, 8);
+        }
+    }
+
+    // Size of each array, followed by its elements (0 if it has not been dimensioned)
+    for (int i = 0; i < DBI_MAX_VARS; i++) {
+        struct Array *array = runtime->arrays[i];
+        put_uint(&writer, array ? array->size : 0, 4);
+        for (long j = 0; array && j < array->size; j++) {
+            put_uint(&writer, array->data[j], 8);
+        }
+    }
+    return writer.len;
+}
+
+// Statement that a GOSUB or FOR frame in a snapshot refers to, if it has `op` at `ip`
+static struct Statement *frame_statement(struct Version *version, struct Program *program,
+        long lineno, long ip, enum Opcode op)
+{
+    if (lineno <= 0 || lineno >= DBI_MAX_PROG_SIZE) {
+        return NULL;
+    }
+    struct Statement *stmt = version->statements[lineno];
+    if (!stmt || (!statement_is_compiled(stmt)
+                && !statement_compile_lazy(stmt, &program->registry->commands))) {
+        return NULL;
+    }
+    uint8_t *code = stmt->bytecode->array;
+    if (ip < 0 || ip >= stmt->bytecode->index || code[ip] != op
+            || ip + op_length(code + ip) > stmt->bytecode->index) {
+        return NULL;
+    }
+    return stmt;
+}
+
+bool dbi_runtime_restore(DbiRuntime dbi, DbiProgram prog, const void *buf, size_t size)
+{
+    struct Runtime *runtime = (struct Runtime *) dbi;
+    struct Program *program = (struct Program *) prog;
+    struct Reader reader = { buf, size, 0, false };
+    memset(global_err_msg, 0, DBI_MAX_ERROR);
+
+    const uint8_t *magic = get_bytes(&reader, 4);
+    if (!magic || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0
+            || get_uint(&reader, 1) != SNAPSHOT_VERSION) {
+        runtime_error(-1, "not a valid snapshot");
+        return false;
+    }
+    uint64_t hash = get_uint(&reader, 8);
+    long lineno = (int32_t) get_uint(&reader, 4);
+    long ip = (int32_t) get_uint(&reader, 4);
+    int callstack_offset = (int32_t) get_uint(&reader, 4);
+    if (lineno <= 0 || lineno >= DBI_MAX_PROG_SIZE || ip < 0 || ip >= DBI_MAX_BYTECODE
+            || callstack_offset < 0 || callstack_offset > DBI_MAX_CALL_STACK
+            || callstack_offset * 8L > (long) (size - reader.pos)) {
+        runtime_error(-1, "corrupt snapshot");
+        return false;
+    }
+
+    // Frames refer to lines by number until version is known
+    long *call_lines = malloc((callstack_offset + 1) * sizeof(*call_lines));
+    struct CallFrame *callstack = malloc((callstack_offset + 1) * sizeof(*callstack));
+    for (int i = 0; i < callstack_offset; i++) {
+        call_lines[i] = (int32_t) get_uint(&reader, 4);
+        callstack[i].ip = (int32_t) get_uint(&reader, 4);
+    }
+
+    long loop_lines[DBI_MAX_LOOP_STACK];
+    struct LoopFrame loops[DBI_MAX_LOOP_STACK];
+    int loop_offset = (int32_t) get_uint(&reader, 4);
+    if (loop_offset < 0 || loop_offset > DBI_MAX_LOOP_STACK) {
+        free(call_lines);
+        free(callstack);
+        runtime_error(-1, "corrupt snapshot");
+        return false;
+    }
+    for (int i = 0; i < loop_offset; i++) {
+        loop_lines[i] = (int32_t) get_uint(&reader, 4);
+        loops[i].ip = (int32_t) get_uint(&reader, 4);
+        loops[i].var = get_uint(&reader, 1);
+        loops[i].limit = (int64_t) get_uint(&reader, 8);
+        loops[i].step = (int64_t) get_uint(&reader, 8);
+    }
+
+    struct Variables *vars = variables_new();
+    for (int i = 0; i < DBI_MAX_VARS && !reader.error; i++) {
+        struct DbiObject *var = &vars->array[i];
+        uint64_t type = get_uint(&reader, 1);
+        if (type == DBI_STR) {
+            size_t len = get_uint(&reader, 4);
+            const uint8_t *str = get_bytes(&reader, len);
+            if (str) {
+                var->type = DBI_STR;
+                var->bstr = malloc(len + 1);
+                memcpy(var->bstr, str, len);
+                var->bstr[len] = '\0';
+            }
+        } else if (type == DBI_INT) {
+            var->bint = (int64_t) get_uint(&reader, 8);
         } else {
-            if (program->statements[stmt->lineno]) {
-                statement_free(program->statements[stmt->lineno]);
+            reader.error = true;
+        }
+    }
+
+    struct Array *arrays[DBI_MAX_VARS] = {0};
+    for (int i = 0; i < DBI_MAX_VARS && !reader.error; i++) {
+        long array_size = get_uint(&reader, 4);
+        // Checked against remaining size first, so a corrupt size can't cause a huge allocation
+        if (array_size > DBI_MAX_ARRAY_SIZE || array_size * 8 > (long) (size - reader.pos)) {
+            reader.error = true;
+        } else if (array_size > 0) {
+            arrays[i] = array_new(array_size);
+            for (long j = 0; j < array_size; j++) {
+                arrays[i]->data[j] = (int64_t) get_uint(&reader, 8);
             }
-            program->statements[stmt->lineno] = stmt;
         }
     }
-    if (file != stdin) {
-        fclose(file);
+    if (reader.error || reader.pos != size) {
+        free(call_lines);
+        free(callstack);
+        variables_release(vars);
+        arrays_release(arrays);
+        runtime_error(-1, "corrupt snapshot");
+        return false;
     }
-    dbi_runtime_free(dbi);
-    return global_err_msg[0] == '\0';
-}
 
-bool dbi_repl(DbiProgram prog, char *input_file_name)
-{
-    return repl(prog, input_file_name, NULL);
-}
+    // Restored runtime resumes on the version the snapshot was checked against
+    struct Version *version = runtime->program == program ? runtime->version : NULL;
+    if (!version) {
+        version = version_pin(program);
+    }
+    bool valid = hash == version_hash(version);
+    if (!valid) {
+        runtime_error(-1, "snapshot was taken from a different program");
+    }
+    for (int i = 0; i < callstack_offset && valid; i++) {
+        callstack[i].stmt = frame_statement(version, program, call_lines[i], callstack[i].ip,
+                OP_CALL);
+        valid = callstack[i].stmt != NULL;
+    }
+    for (int i = 0; i < loop_offset && valid; i++) {
+        loops[i].stmt = frame_statement(version, program, loop_lines[i], loops[i].ip - 1, OP_FOR);
+        valid = loops[i].stmt != NULL && loops[i].stmt->bytecode->array[loops[i].ip] == loops[i].var;
+    }
+    free(call_lines);
+    if (!valid) {
+        if (version != runtime->version) {
+            version_unpin(program, version);
+        }
+        free(callstack);
+        variables_release(vars);
+        arrays_release(arrays);
+        if (global_err_msg[0] == '\0') {
+            runtime_error(-1, "corrupt snapshot");
+        }
+        return false;
+    }
+    if (version != runtime->version) {
+        if (runtime->version) {
+            version_unpin(runtime->program, runtime->version);
+        }
+        runtime->version = version;
+        runtime->program = program;
+    }
 
-bool dbi_repl_with_context(DbiProgram prog, char *input_file_name, void *context)
-{
-    return repl(prog, input_file_name, context);
+    variables_release(runtime->vars);
+    runtime->vars = vars;
+    arrays_release(runtime->arrays);
+    memcpy(runtime->arrays, arrays, sizeof(arrays));
+    runtime->lineno = lineno;
+    runtime->ip = ip;
+    free(runtime->callstack);
+    runtime->callstack = callstack;
+    runtime->callstack_offset = callstack_offset;
+    runtime->callstack_size = callstack_offset + 1;
+    runtime->loop_offset = loop_offset;
+    memcpy(runtime->loops, loops, loop_offset * sizeof(*loops));
+    return true;
 }
 
-struct Code {
-    bool isfile; // 1 = file, 0 = text
-    union {
-        FILE *file;
-        char *text;
-    };
+// *******************************************************************
+// ****************************** Images ***************************** 
+// *******************************************************************
+
+/*
+ * Compiled programs can be saved as an image, which can be loaded with mmap and executed without
+ * being parsed again. All integers are little endian and all offsets are relative to the start of
+ * the section they point into, so an image can be mapped at any address.
+ *
+ * header     magic, version, counts and offsets of each of the following sections
+ * lines      for each line: line number, bytecode range, constant range, text offset, whether
+ *            it was optimized and the range of bytecode inlined from another line
+ * bytecode   bytecode of every line, executed in place
+ * constants  for each constant: type, value (integer, variable, string offset or FFI index)
+ * strings    NUL-terminated string constants and line text
+ * ffi        for each foreign call used: name offset, argc, flags (macro, borrows arguments, typed,
+ *            function, async and result type) and signature offset (empty if untyped)
+ */
+
+#define IMAGE_MAGIC "DBIC"
+// Must be incremented whenever the bytecode or image layout changes
+#define IMAGE_VERSION 10
+
+#define IMAGE_HEADER_SIZE 44
+#define IMAGE_LINE_SIZE 40
+#define IMAGE_CONST_SIZE 12
+#define IMAGE_FFI_SIZE 16
+
+// Only used in images. Marks constant that holds an index into the image's FFI table.
+#define IMAGE_CONST_FFI 3
+
+struct Image {
+    uint8_t *map;
+    size_t size;
+    struct Statement *statements;
+    struct Memory *memories;
+    struct Bytecode *bytecodes;
+    struct DbiObject *constants;
+    struct DbiObject **constant_ptrs;
+    struct Image *next;
 };
 
-static bool code_init_file(struct Code *code, char *input_file_name)
+static void images_free(struct Image *image)
 {
-    code->isfile = true;
-    code->file = fopen(input_file_name, "r");
-    if (!code->file) {
-        runtime_error(-1, "%s", strerror(errno));
-        return false;
+    while (image != NULL) {
+        struct Image *next = image->next;
+        munmap(image->map, image->size);
+        free(image->statements);
+        free(image->memories);
+        free(image->bytecodes);
+        free(image->constants);
+        free(image->constant_ptrs);
+        free(image);
+        image = next;
     }
-    return true;
-}
-
-static void code_init_text(struct Code *code, char *text)
-{
-    code->isfile = false;
-    code->text = text;
 }
 
-// Not necessary to call this for non-file input - but doesn't hurt either
-static void code_free(struct Code *code)
+// Everything about how a foreign call is invoked, apart from its name, argc and signature
+static uint32_t foreign_call_flags(struct ForeignCall *fc)
 {
-    if (code->isfile) {
-        fclose(code->file);
-        code->file = NULL;
-    }
+    return fc->is_macro | fc->borrows_args << 1 | (fc->typed_call != NULL) << 2
+        | (fc->function != NULL) << 3 | (fc->async_call != NULL) << 4 | fc->result_type << 5;
 }
 
-// fgets replacement for not-file inputs
-static char *cgets(char s[DBI_MAX_LINE_LENGTH], int size, struct Code *code)
+static uint32_t put_string(struct Writer *strings, char *str, size_t len)
 {
-    if (code->isfile) {
-        return fgets(s, size, code->file);
-    } else {
-        ignore_whitespace(&code->text);
-        if (*code->text == '\0') {
-            return NULL;
-        }
-        int i = 0;
-        for (i = 0; *code->text != '\0' && *code->text != '\n'; i++) {
-            if (i == DBI_MAX_LINE_LENGTH - 1) {
-                return NULL;
-            }
-            s[i] = *code->text;
-            code->text++;
-        }
-        return s;
-    }
+    uint32_t offset = strings->len;
+    put_bytes(strings, str, len);
+    put_bytes(strings, "", 1);
+    return offset;
 }
 
-// Boilerplate setup / cleanup for compiling
-static bool compile(struct Code *code, struct Program *program)
+static bool image_write(struct Program *program, struct Statement **statements, FILE *file)
 {
-    char input[DBI_MAX_LINE_LENGTH];
-
-    struct DbiObject *temp_memory_array[DBI_MAX_LINE_MEMORY];
-    struct Memory temp_memory = { 0, temp_memory_array };
-
-    uint8_t temp_bytecode_array[DBI_MAX_BYTECODE];
-    struct Bytecode temp_bytecode = { 0, temp_bytecode_array };
-
-    bool input_error = false;
+    struct Writer lines = { .grow = true };
+    struct Writer code = { .grow = true };
+    struct Writer consts = { .grow = true };
+    struct Writer strings = { .grow = true };
+    struct Writer ffi = { .grow = true };
+
+    uint32_t line_count = 0;
+    uint32_t const_count = 0;
+    uint32_t ffi_count = 0;
+
+    // Only foreign calls used by the program are written to the image.
+    // Maps index in program->registry->commands.foreign_calls to index in image's FFI table.
+    int registered_count = program->registry->commands.foreign_call_count;
+    int *ffi_map = malloc((registered_count + 1) * sizeof(*ffi_map));
+    memset(ffi_map, -1, (registered_count + 1) * sizeof(*ffi_map));
 
-    while (true) {
-        temps_init(input, &temp_memory, &temp_bytecode);
-        if (!cgets(input, DBI_MAX_LINE_LENGTH, code)) {
-            break;
+    for (long i = 0; i < DBI_MAX_PROG_SIZE; i++) {
+        struct Statement *stmt = statements[i];
+        if (!stmt) {
+            continue;
         }
-
-        /* If user gives a line that exceeds length, ignore fgets input until we're parsed the
-         * whole line */
-        if (input[DBI_MAX_LINE_LENGTH - 2] != '\0') {
-            if (!input_error) {
-                runtime_error(-1, "input line too long");
+        put_uint(&lines, stmt->lineno, 4);
+        put_uint(&lines, code.len, 4);
+        put_uint(&lines, stmt->bytecode->index, 4);
+        put_uint(&lines, const_count, 4);
+        put_uint(&lines, stmt->memory->index, 4);
+        put_uint(&lines, put_string(&strings, stmt->line, stmt->line_len), 4);
+        put_uint(&lines, stmt->optimized, 4);
+        put_uint(&lines, stmt->inline_start, 4);
+        put_uint(&lines, stmt->inline_end, 4);
+        put_uint(&lines, stmt->inline_lineno, 4);
+        line_count++;
+
+        // Foreign calls are numbered in registration order, which may be different when the
+        // image is loaded, so the constants holding FFI indexes need to be marked
+        bool is_ffi[DBI_MAX_LINE_MEMORY] = {0};
+        uint8_t *array = stmt->bytecode->array;
+        for (int ip = 0; ip < stmt->bytecode->index; ip += op_length(array + ip)) {
+            if (array[ip] == OP_PUSH && ip + 2 < stmt->bytecode->index
+                    && (array[ip + 2] == OP_FFI_CALL || array[ip + 2] == OP_FFI_TYPED_CALL
+                        || array[ip + 2] == OP_FFI_FUNC)) {
+                is_ffi[array[ip + 1]] = true;
             }
-            input_error = true;
-            continue;
-        } else if (input_error) {
-            input_error = false;
-            continue;
         }
-
-        struct Statement *stmt = compile_line(input, program->foreign_calls,
-                &temp_memory, &temp_bytecode);
-        if (!stmt) {
-            /* Error */
-        } else if (stmt->lineno == 0) {
-            /* No line number is an error in compile mode */
-            compile_error("statement missing line number");
-            statement_free(stmt);
-        } else {
-            if (program->statements[stmt->lineno]) {
-                statement_free(program->statements[stmt->lineno]);
+        put_bytes(&code, array, stmt->bytecode->index);
+
+        for (int j = 0; j < stmt->memory->index; j++) {
+            struct DbiObject *obj = stmt->memory->array[j];
+            if (is_ffi[j]) {
+                assert(obj->bint >= 0 && obj->bint < registered_count);
+                if (ffi_map[obj->bint] == -1) {
+                    struct ForeignCall *fc = program->registry->commands.foreign_calls[obj->bint];
+                    put_uint(&ffi, put_string(&strings, fc->name, strlen(fc->name)), 4);
+                    put_uint(&ffi, (uint32_t) fc->argc, 4);
+                    put_uint(&ffi, foreign_call_flags(fc), 4);
+                    char *signature = fc->signature ? fc->signature : "";
+                    put_uint(&ffi, put_string(&strings, signature, strlen(signature)), 4);
+                    ffi_map[obj->bint] = ffi_count++;
+                }
+                put_uint(&consts, IMAGE_CONST_FFI, 4);
+                put_uint(&consts, ffi_map[obj->bint], 8);
+            } else if (obj->type == DBI_STR) {
+                put_uint(&consts, DBI_STR, 4);
+                put_uint(&consts, put_string(&strings, obj->bstr, strlen(obj->bstr)), 8);
+            } else if (obj->type == DBI_VAR) {
+                put_uint(&consts, DBI_VAR, 4);
+                put_uint(&consts, obj->bvar, 8);
+            } else {
+                put_uint(&consts, DBI_INT, 4);
+                put_uint(&consts, obj->bint, 8);
             }
-            program->statements[stmt->lineno] = stmt;
+            const_count++;
         }
     }
-    return global_err_msg[0] == '\0';
-}
-
-static bool compile_code(DbiProgram prog, struct Code *code)
-{
-    if (!prog) {
-        compile_error("empty program");
-        return false;
+    free(ffi_map);
+
+    struct Writer header = { .grow = true };
+    uint32_t offset = IMAGE_HEADER_SIZE;
+    put_bytes(&header, IMAGE_MAGIC, 4);
+    put_uint(&header, IMAGE_VERSION, 4);
+    put_uint(&header, line_count, 4);
+    put_uint(&header, const_count, 4);
+    put_uint(&header, ffi_count, 4);
+    struct Writer *sections[] = { &lines, &code, &consts, &strings, &ffi };
+    for (int i = 0; i < 5; i++) {
+        put_uint(&header, offset, 4);
+        offset += sections[i]->len;
     }
-    memset(global_err_msg, 0, DBI_MAX_ERROR);
-    struct Program *program = (struct Program *) prog;
-
-    if (!program->has_compiled) {
-        foreign_call_table_init(program);
-        program->has_compiled = true;
+    put_uint(&header, offset, 4);
+    assert(header.len == IMAGE_HEADER_SIZE);
+
+    bool ret = fwrite(header.data, 1, header.len, file) == header.len;
+    free(header.data);
+    for (int i = 0; i < 5; i++) {
+        if (ret && sections[i]->len > 0) {
+            ret = fwrite(sections[i]->data, 1, sections[i]->len, file) == sections[i]->len;
+        }
+        free(sections[i]->data);
     }
-    bool ret = compile(code, program);
-
     return ret;
 }
 
-// Only compile - disallow non-numbered commands
-bool dbi_compile_file(DbiProgram prog, char *input_file_name)
+bool dbi_save_image(DbiProgram prog, char *file_name)
 {
-    struct Code code;
-    if (!code_init_file(&code, input_file_name)) {
+    struct Program *program = (struct Program *) prog;
+    memset(global_err_msg, 0, DBI_MAX_ERROR);
+    struct Version *version = version_pin(program);
+    if (!program_compile_lazy(version->statements, &program->registry->commands)) {
+        version_unpin(program, version);
         return false;
     }
-    bool ret = compile_code(prog, &code);
-    code_free(&code);
-    return ret;
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        version_unpin(program, version);
+        runtime_error(-1, "%s", strerror(errno));
+        return false;
+    }
+    bool ret = image_write(program, version->statements, file);
+    version_unpin(program, version);
+    if (fclose(file) != 0 || !ret) {
+        runtime_error(-1, "could not write image %s", file_name);
+        return false;
+    }
+    return true;
 }
 
-bool dbi_compile_string(DbiProgram prog, char *text)
+static bool is_image_file(char *file_name)
 {
-    struct Code code;
-    code_init_text(&code, text);
-    bool ret = compile_code(prog, &code);
-    code_free(&code);
+    char magic[4];
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        return false;
+    }
+    bool ret = fread(magic, 1, 4, file) == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+    fclose(file);
     return ret;
 }
 
-void register_command(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example, bool is_macro)
+// Checks that every instruction in line only references memory that exists
+static bool image_check_bytecode(uint8_t *code, int len, int const_count)
 {
-    assert(argc >= -1);
-    struct Program *program = (struct Program *) prog;
-    assert(!program->has_compiled);
-    struct ForeignCall *fc = malloc(sizeof(*fc));
-    fc->is_macro = is_macro;
-    fc->argc = argc;
-    fc->name = name;
-    fc->docstring = docstring;
-    fc->example = example;
-    // Commands must be all caps, no other letters
-    while (*name != '\0') {
-        if (!(*name >= 'A' && *name <= 'Z')) {
-            printf("Improper usage: command name must be uppercase, letters A-Z\n");
-            assert(false);
+    int ip = 0;
+    while (ip < len) {
+        if (code[ip] == OP_INPUT && ip + 1 < len) {
+            for (int i = 0; i < code[ip + 1] && ip + 2 + i < len; i++) {
+                if (code[ip + 2 + i] >= DBI_MAX_VARS) {
+                    return false;
+                }
+            }
         }
-        name++;
-    }
-    fc->call = call;
-    fc->next = NULL;
-    int count = 1;
-    if (program->foreign_calls == NULL) {
-        fc->extended_command_code = LAST_COMMAND + count;
-        program->foreign_calls = fc;
-        return;
-    }
-    struct ForeignCall *fc_temp = program->foreign_calls;
-    while (true) {
-        assert(strcmp(fc_temp->name, fc->name) != 0);
-        count++;
-        if (fc_temp->next == NULL) {
-            break;
+        int op_len = op_length(code + ip);
+        if (ip + op_len > len) {
+            return false;
+        } else if (code[ip] == OP_PUSH && code[ip + 1] >= const_count) {
+            return false;
+        } else if ((code[ip] == OP_LET || code[ip] == OP_FOR || code[ip] == OP_DIM
+                    || code[ip] == OP_AGET || code[ip] == OP_ASET) && code[ip + 1] >= DBI_MAX_VARS) {
+            return false;
+        } else if (code[ip] == OP_NEXT && code[ip + 1] > NEXT_ANY_VAR) {
+            return false;
+        } else if (code[ip] == OP_FFI_FUNC && code[ip + 1] >= DBI_MAX_STACK) {
+            return false;
         }
-        fc_temp = fc_temp->next;
+        ip += op_len;
     }
-    fc->extended_command_code = LAST_COMMAND + count;
-    fc_temp->next = fc;
+    return true;
 }
 
-void dbi_register_command(DbiProgram prog, char *name, DbiForeignCall call, int argc)
+// Maps image into memory. Bytecode, strings and line text are used in place, only the
+// statement / constant tables are allocated.
+static bool image_load(struct Program *program, char *file_name)
 {
-    register_command(prog, name, call, argc, NULL, NULL, false);
-}
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        runtime_error(-1, "%s", strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < IMAGE_HEADER_SIZE) {
+        close(fd);
+        runtime_error(-1, "invalid image %s", file_name);
+        return false;
+    }
+    size_t size = st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        runtime_error(-1, "%s", strerror(errno));
+        return false;
+    }
 
-void dbi_register_command_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example)
-{
-    register_command(prog, name, call, argc, docstring, example, false);
-}
+    struct Reader reader = { map, size, 0, false };
+    get_bytes(&reader, 4);
+    uint32_t version = get_uint(&reader, 4);
+    uint32_t line_count = get_uint(&reader, 4);
+    uint32_t const_count = get_uint(&reader, 4);
+    uint32_t ffi_count = get_uint(&reader, 4);
+    uint32_t offsets[6];
+    for (int i = 0; i < 6; i++) {
+        offsets[i] = get_uint(&reader, 4);
+    }
+    uint8_t *lines = map + offsets[0];
+    uint8_t *code = map + offsets[1];
+    uint8_t *consts = map + offsets[2];
+    char *strings = (char *) map + offsets[3];
+    uint8_t *ffi = map + offsets[4];
+    size_t code_size = offsets[2] - offsets[1];
+    size_t strings_size = offsets[4] - offsets[3];
+
+    if (version != IMAGE_VERSION) {
+        munmap(map, size);
+        runtime_error(-1, "image %s was compiled by a different version of dbi", file_name);
+        return false;
+    }
+    bool valid = offsets[5] == size && offsets[0] == IMAGE_HEADER_SIZE;
+    for (int i = 0; i < 5 && valid; i++) {
+        valid = offsets[i] <= offsets[i + 1];
+    }
+    valid = valid && offsets[1] - offsets[0] == (uint64_t) line_count * IMAGE_LINE_SIZE
+        && offsets[3] - offsets[2] == (uint64_t) const_count * IMAGE_CONST_SIZE
+        && offsets[5] - offsets[4] == (uint64_t) ffi_count * IMAGE_FFI_SIZE
+        && (strings_size == 0 || strings[strings_size - 1] == '\0');
+    if (!valid) {
+        munmap(map, size);
+        runtime_error(-1, "invalid image %s", file_name);
+        return false;
+    }
 
-void dbi_register_macro(DbiProgram prog, char *name, DbiForeignCall call, int argc)
-{
-    register_command(prog, name, call, argc, NULL, NULL, true);
-}
+    // Check foreign calls used by image against registered commands
+    int *ffi_map = calloc(ffi_count + 1, sizeof(*ffi_map));
+    for (uint32_t i = 0; i < ffi_count && valid; i++) {
+        struct Reader entry = { ffi + i * IMAGE_FFI_SIZE, IMAGE_FFI_SIZE, 0, false };
+        uint32_t name = get_uint(&entry, 4);
+        int argc = (int32_t) get_uint(&entry, 4);
+        uint32_t flags = get_uint(&entry, 4);
+        uint32_t signature = get_uint(&entry, 4);
+        if (name >= strings_size || signature >= strings_size) {
+            valid = false;
+            break;
+        }
+        struct CommandEntry *command = command_index_find(&program->registry->commands, strings + name,
+                strlen(strings + name));
+        struct ForeignCall *fc = command ? command->fc : NULL;
+        if (fc == NULL || fc->argc != argc || foreign_call_flags(fc) != flags
+                || strcmp(fc->signature ? fc->signature : "", strings + signature) != 0) {
+            runtime_error(-1, "image %s uses command %s, which is %s", file_name, strings + name,
+                    fc == NULL ? "not registered" : "registered with a different signature");
+            free(ffi_map);
+            munmap(map, size);
+            return false;
+        }
+        ffi_map[i] = fc->extended_command_code - LAST_COMMAND - 1;
+    }
 
-void dbi_register_macro_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example)
-{
-    register_command(prog, name, call, argc, docstring, example, true);
-}
+    struct Image *image = calloc(1, sizeof(*image));
+    image->map = map;
+    image->size = size;
+    image->statements = calloc(line_count + 1, sizeof(*image->statements));
+    image->memories = calloc(line_count + 1, sizeof(*image->memories));
+    image->bytecodes = calloc(line_count + 1, sizeof(*image->bytecodes));
+    image->constants = calloc(const_count + 1, sizeof(*image->constants));
+    image->constant_ptrs = calloc(const_count + 1, sizeof(*image->constant_ptrs));
+
+    for (uint32_t i = 0; i < const_count && valid; i++) {
+        struct Reader entry = { consts + i * IMAGE_CONST_SIZE, IMAGE_CONST_SIZE, 0, false };
+        uint32_t type = get_uint(&entry, 4);
+        uint64_t value = get_uint(&entry, 8);
+        struct DbiObject *obj = &image->constants[i];
+        if (type == DBI_INT) {
+            obj->type = DBI_INT;
+            obj->bint = (int64_t) value;
+        } else if (type == DBI_STR && value < strings_size) {
+            obj->type = DBI_STR;
+            obj->bstr = strings + value;
+        } else if (type == DBI_VAR && value < DBI_MAX_VARS) {
+            obj->type = DBI_VAR;
+            obj->bvar = value;
+        } else if (type == IMAGE_CONST_FFI && value < ffi_count) {
+            obj->type = DBI_INT;
+            obj->bint = ffi_map[value];
+        } else {
+            valid = false;
+        }
+        image->constant_ptrs[i] = obj;
+    }
+    free(ffi_map);
+
+    for (uint32_t i = 0; i < line_count && valid; i++) {
+        struct Reader entry = { lines + i * IMAGE_LINE_SIZE, IMAGE_LINE_SIZE, 0, false };
+        uint32_t lineno = get_uint(&entry, 4);
+        uint32_t code_offset = get_uint(&entry, 4);
+        uint32_t code_len = get_uint(&entry, 4);
+        uint32_t const_start = get_uint(&entry, 4);
+        uint32_t line_const_count = get_uint(&entry, 4);
+        uint32_t line = get_uint(&entry, 4);
+        uint32_t optimized = get_uint(&entry, 4);
+        uint32_t inline_start = get_uint(&entry, 4);
+        uint32_t inline_end = get_uint(&entry, 4);
+        uint32_t inline_lineno = get_uint(&entry, 4);
+        valid = lineno > 0 && lineno < DBI_MAX_PROG_SIZE
+            && code_len <= DBI_MAX_BYTECODE && code_offset <= code_size
+            && code_len <= code_size - code_offset
+            && line_const_count <= DBI_MAX_LINE_MEMORY && const_start <= const_count
+            && line_const_count <= const_count - const_start
+            && line < strings_size && optimized <= 1
+            && inline_start <= inline_end && inline_end <= code_len
+            && inline_lineno < DBI_MAX_PROG_SIZE
+            && image_check_bytecode(code + code_offset, code_len, line_const_count);
+
+        struct Statement *stmt = &image->statements[i];
+        stmt->lineno = lineno;
+        stmt->line = strings + line;
+        stmt->line_len = strlen(stmt->line);
+        stmt->hash = line_hash(stmt->line, stmt->line_len);
+        stmt->borrowed = true;
+        stmt->optimized = optimized;
+        stmt->inline_start = inline_start;
+        stmt->inline_end = inline_end;
+        stmt->inline_lineno = inline_lineno;
+        stmt->memory = &image->memories[i];
+        stmt->memory->index = line_const_count;
+        stmt->memory->array = image->constant_ptrs + const_start;
+        stmt->bytecode = &image->bytecodes[i];
+        stmt->bytecode->index = code_len;
+        stmt->bytecode->array = code + code_offset;
+    }
 
-// Executes program in runtime
-enum DbiStatus dbi_run(DbiRuntime dbi, DbiProgram prog)
-{
-    memset(global_err_msg, 0, DBI_MAX_ERROR);
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    struct Program *program = (struct Program *) prog;
-    runtime->program = program;
-    struct Statement *stmt = statement_next(program->statements, runtime->lineno);
-    if (!stmt) {
-        dbi_runtime_reset(runtime);
-        return DBI_STATUS_FINISHED;
+    if (!valid) {
+        image->next = NULL;
+        images_free(image);
+        runtime_error(-1, "invalid image %s", file_name);
+        return false;
     }
-    enum DbiStatus status = execute_line(runtime, stmt, program, true);
-    if (status == DBI_STATUS_YIELD) {
-        return status;
-    } else {
-        dbi_runtime_reset(runtime);
-        return status;
+    struct Statement **stmts = malloc((line_count + 1) * sizeof(*stmts));
+    for (uint32_t i = 0; i < line_count; i++) {
+        stmts[i] = &image->statements[i];
     }
+    pthread_mutex_lock(&program->update_lock);
+    image->next = program->images;
+    program->images = image;
+    pthread_mutex_unlock(&program->update_lock);
+    program_update(program, stmts, line_count, false);
+    free(stmts);
+    return true;
 }
 
-int dbi_get_argc(DbiRuntime dbi)
-{
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    return runtime->ffi_argc;
-}
+// *******************************************************************
+// *************************** Compile Cache ************************* 
+// *******************************************************************
 
-struct DbiObject **dbi_get_argv(DbiRuntime dbi)
-{
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    return runtime->ffi_argv;
-}
+/*
+ * Files compiled with a cache directory set are stored there as images, named after a hash of
+ * everything that affects the compiled output: the image version, the registered commands and
+ * the source text. An entry is never modified once written, so a stale or foreign entry can only
+ * ever be a hash collision, and an entry that fails to load is simply recompiled.
+ */
 
-// Context can be used to pass data between C and dbi in foreign calls
-void dbi_set_context(DbiRuntime dbi, void *context)
+void dbi_set_compile_cache(DbiProgram prog, char *dir)
 {
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    runtime->context = context;
+    struct Program *program = (struct Program *) prog;
+    free(program->cache_dir);
+    program->cache_dir = dir ? strdup(dir) : NULL;
 }
 
-void *dbi_get_context(DbiRuntime dbi)
+void dbi_get_cache_stats(DbiProgram prog, long *hits, long *misses)
 {
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    return runtime->context;
+    struct Program *program = (struct Program *) prog;
+    *hits = atomic_load(&program->cache_hits);
+    *misses = atomic_load(&program->cache_misses);
 }
 
-// Get / set object associated with var
-struct DbiObject *dbi_get_var(DbiRuntime dbi, char var)
+static uint64_t cache_key(struct Program *program, char *text, size_t len)
 {
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    assert((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'));
-    int offset = var >= 'a' ? 'a' : 'A';
-    return runtime->vars[var - offset];
+    uint64_t hash = FNV_OFFSET;
+    uint32_t version = IMAGE_VERSION;
+    hash = hash_bytes(hash, &version, sizeof(version));
+    for (struct ForeignCall *fc = program->registry->foreign_calls; fc != NULL; fc = fc->next) {
+        hash = hash_bytes(hash, fc->name, strlen(fc->name) + 1);
+        hash = hash_bytes(hash, &fc->argc, sizeof(fc->argc));
+        uint32_t flags = foreign_call_flags(fc);
+        hash = hash_bytes(hash, &flags, sizeof(flags));
+        if (fc->signature) {
+            hash = hash_bytes(hash, fc->signature, strlen(fc->signature) + 1);
+        }
+    }
+    return hash_bytes(hash, text, len);
 }
 
-void dbi_set_var(DbiRuntime dbi, char var, struct DbiObject *obj)
+// Writes image to a temporary file first and renames it into place, so that other processes
+// only ever see complete entries
+static void cache_store(struct Program *program, struct Statement **statements, char *path)
 {
-    struct Runtime *runtime = (struct Runtime *) dbi;
-    assert((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'));
-    assert(obj);
-    if (obj->type == DBI_VAR) {
-        obj = dbi_get_var(dbi, obj->bvar);
+    char temp_path[PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    if (fd == -1) {
+        return;
     }
-    assert(obj->type != DBI_VAR);
-    int offset = var >= 'a' ? 'a' : 'A';
-    struct DbiObject *varobj = runtime->vars[var - offset];
-    if (varobj->type == DBI_STR && varobj->bstr != NULL) {
-        free(varobj->bstr);
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        remove(temp_path);
+        return;
     }
-    if (obj->type == DBI_STR) {
-        varobj->type = DBI_STR;
-        varobj->bstr = obj->bstr ? strdup(obj->bstr) : NULL;
-    } else {
-        varobj->type = DBI_INT;
-        varobj->bint = obj->bint;
+    bool ret = image_write(program, statements, file);
+    if (fclose(file) != 0 || !ret || rename(temp_path, path) != 0) {
+        remove(temp_path);
     }
 }
 
-char *dbi_get_line(DbiProgram prog, long lineno)
-{
-    assert(lineno > 0);
-    assert(lineno < DBI_MAX_PROG_SIZE);
-    struct Program *program = (struct Program *) prog;
-    struct Statement *stmt = program->statements[lineno];
-    return stmt ? stmt->line : NULL;
-}
-
-void dbi_print_compiled(DbiProgram prog)
+static bool compile_file_cached(struct Program *program, char *file_name, int threads)
 {
-    struct Program *program = (struct Program *) prog;
-    assert(program->has_compiled);
-    program_listb(program->statements);
+    struct Source *source = source_open(file_name);
+    if (!source) {
+        return false;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.dbc", program->cache_dir,
+            (unsigned long long) cache_key(program, source->text, source->size));
+
+    if (access(path, R_OK) == 0) {
+        if (image_load(program, path)) {
+            atomic_fetch_add(&program->cache_hits, 1);
+            source_free(source);
+            return true;
+        }
+        memset(global_err_msg, 0, DBI_MAX_ERROR);
+    }
+    atomic_fetch_add(&program->cache_misses, 1);
+
+    // Lines are always compiled eagerly and from scratch here, since the cache stores bytecode.
+    // Images cannot delete lines, so files that do are not cached.
+    pthread_mutex_lock(&program->update_lock);
+    struct Statement **statements = compile_source(program, source, threads, false, false);
+    bool ret = global_err_msg[0] == '\0';
+    bool deletes = false;
+    for (int i = 0; i < DBI_MAX_PROG_SIZE && ret; i++) {
+        deletes = deletes || (statements[i] && statement_is_deleted(statements[i]));
+    }
+    if (ret && !deletes) {
+        cache_store(program, statements, path);
+    }
+    program_update_table(program, statements, false);
+    pthread_mutex_unlock(&program->update_lock);
+    return ret;
 }
-
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Should be set to *at least* whatever longest command name is (+1 character for null byte)
 #define DBI_MAX_COMMAND_NAME 32 
@@ -10,14 +11,22 @@
 // Arbitrary - adjust as needed
 #define DBI_MAX_PROG_SIZE 10000
 #define DBI_MAX_LINE_LENGTH 256 // Max number of chars that can be parsed in one line
+                                // (only applies to the repl and INPUT)
 #define DBI_MAX_STACK 128       // Max number of arithmatic expressions that can be on the stack
-#define DBI_MAX_CALL_STACK 16   // Max depth of call stack (GOSUB's / RETURN)
+#define DBI_MAX_CALL_STACK 100000 // Max depth of call stack (GOSUB's / RETURN). The stack
+                                  // starts small and grows as needed
+#define DBI_MAX_LOOP_STACK 16   // Max number of nested FOR loops
+#define DBI_MAX_ARRAY_SIZE 1000000 // Max number of elements in an array
 #define DBI_MAX_LINE_MEMORY 64  // Max number of variables, numbers, or strings in one line
                                 // NOTE: this should never be set to more than 256 since it will get
                                 //       used as a uint8_t
 #define DBI_MAX_BYTECODE 64
 #define DBI_MAX_ITERATIONS 999999 // Maximum number of iterations of VM loop before aborting
+#define DBI_DEADLINE_POLL_INTERVAL 1024 // Min number of VM iterations between clock reads when
+                                        // running with a deadline
 #define DBI_MAX_ERROR 512
+#define DBI_ASYNC_THREADS 4 // Number of threads that async commands run on
+#define DBI_OUTPUT_BUFFER 4096 // Size of each runtime's output buffer
 
 // Toggling turns on some debug printing
 #define DBI_DEBUG 0
@@ -48,17 +57,32 @@ struct DbiObject {
     };
 };
 
+// Argument of typed command
+union DbiValue {
+    long bint;
+    const char *bstr;
+};
+
 enum DbiStatus {
     DBI_STATUS_GOOD,
     DBI_STATUS_FINISHED,
     DBI_STATUS_YIELD,
-    DBI_STATUS_ERROR
+    DBI_STATUS_ERROR,
+    DBI_STATUS_TIMEOUT,
+    DBI_STATUS_WAITING,
+    DBI_STATUS_INPUT
 };
 
 typedef uintptr_t DbiProgram;
 typedef uintptr_t DbiRuntime;
+typedef uintptr_t DbiRegistry;
+typedef uintptr_t DbiTimers;
 
 typedef enum DbiStatus (*DbiForeignCall)(DbiRuntime dbi);
+typedef enum DbiStatus (*DbiTypedCall)(DbiRuntime dbi, int argc, union DbiValue *args);
+typedef void (*DbiOutput)(void *ctx, const char *buf, size_t len);
+typedef enum DbiStatus (*DbiAsyncCall)(void *context, int argc, union DbiValue *args);
+typedef enum DbiStatus (*DbiFunction)(DbiRuntime dbi, int argc, union DbiValue *args, union DbiValue *result);
 
 // Allows C function to be called as a command
 // If argc is -1, then the command can take one or more arguments. Otherwise, argc is the
@@ -69,19 +93,123 @@ typedef enum DbiStatus (*DbiForeignCall)(DbiRuntime dbi);
 void dbi_register_command(DbiProgram prog, char *name, DbiForeignCall call, int argc);
 void dbi_register_command_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example);
 
+// Same as registering a command, except that arguments are not copied into the argument list.
+// dbi_get_argv instead returns views of the values as they were evaluated: strings point to the
+// program's constants and to variables in place. The arguments must not be modified, and are
+// only valid until the command returns or sets a variable (setting a string variable frees its
+// old string). Commands that need to keep their arguments should use dbi_register_command.
+void dbi_register_borrowing_command(DbiProgram prog, char *name, DbiForeignCall call, int argc);
+void dbi_register_borrowing_command_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example);
+
+// Registers command with a typed signature: one character per argument, I for an integer or S for
+// a string, and a trailing '*' if the last type can be repeated (e.g. "SI*" is a string followed
+// by one or more integers). Literal arguments of the wrong type are compile errors, and other
+// arguments are checked before the command is called, so `call` receives the values directly in
+// args[i].bint / args[i].bstr. Arguments are borrowed, as with dbi_register_borrowing_command.
+void dbi_register_typed_command(DbiProgram prog, char *name, DbiTypedCall call, char *signature);
+void dbi_register_typed_command_with_info(DbiProgram prog, char *name, DbiTypedCall call, char *signature, char *docstring, char *example);
+
+// Registers function that can be called in expressions, e.g. `LET X = HASH(A) + 1`. Arguments
+// are checked against `signature` as for typed commands, and `call` stores its return value, of
+// type `result_type` (DBI_INT or DBI_STR), in `result`. A string result is not copied, so it must
+// stay valid until the line calling the function finishes. Functions must return either
+// DBI_STATUS_GOOD or DBI_STATUS_ERROR. Function names must be at least two letters long.
+void dbi_register_function(DbiProgram prog, char *name, DbiFunction call, char *signature, enum DbiType result_type);
+void dbi_register_function_with_info(DbiProgram prog, char *name, DbiFunction call, char *signature, enum DbiType result_type, char *docstring, char *example);
+
+// Registers command that runs on a thread pool instead of the thread running the program, for
+// commands that block (e.g. on IO). Arguments are checked against `signature` as for typed
+// commands, and strings are copied. Since `call` runs on another thread, it gets the runtime's
+// context rather than the runtime, and must not call any dbi_* function. It must return either
+// DBI_STATUS_GOOD or DBI_STATUS_ERROR.
+// When a program reaches an async command, dbi_run returns DBI_STATUS_WAITING. Calling dbi_run
+// again returns DBI_STATUS_WAITING until the command has finished, and then resumes the program
+// just after it. This lets one thread run many programs that are each waiting on slow commands.
+// A runtime that is waiting can't be forked or saved. In the repl, async commands run in place.
+void dbi_register_async_command(DbiProgram prog, char *name, DbiAsyncCall call, char *signature);
+void dbi_register_async_command_with_info(DbiProgram prog, char *name, DbiAsyncCall call, char *signature, char *docstring, char *example);
+
+// Gets file descriptor that becomes readable whenever an async command finishes, e.g. to wait for
+// waiting programs with poll(). It is non-blocking: read and discard what is available, then call
+// dbi_run on the waiting runtimes.
+int dbi_async_fd(void);
+
 // Registering a macro is the same as registering a command, except that it doesn't evaluate variables passed in
 void dbi_register_macro(DbiProgram prog, char *name, DbiForeignCall call, int argc);
 void dbi_register_macro_with_info(DbiProgram prog, char *name, DbiForeignCall call, int argc, char *docstring, char *example);
 
 // Note: all C function commands must be registered before compilation.
 //       dbi_compile_* functions can be called multiple times with different inputs. If the line
-//       number overlaps with an existing line, the existing line will be overwritten.
+//       number overlaps with an existing line, the existing line will be overwritten. A line
+//       number on its own deletes that line.
+//
+//       dbi_compile_file also accepts images created by dbi_save_image.
 bool dbi_compile_file(DbiProgram prog, char *input_file_name);
 bool dbi_compile_string(DbiProgram prog, char *text);
 
+// Same as above, but large inputs are split into chunks that are compiled on up to `threads`
+// threads (one per CPU if `threads` <= 0). The result, including the order of error messages,
+// is the same as compiling on one thread.
+bool dbi_compile_file_parallel(DbiProgram prog, char *input_file_name, int threads);
+bool dbi_compile_string_parallel(DbiProgram prog, char *text, int threads);
+
+// Atomically updates a program that runtimes on other threads may be running: either every line
+// in `text` is applied at once (replacing or deleting lines as with dbi_compile_string), or, if
+// any line fails to compile, none are. Runtimes already running finish on the version of the
+// program they started with, and the lines they may still use are freed once no runtime is
+// running that version. Runs never wait for an update, or for each other.
+// dbi_compile_* can also be called on a running program, but apply the lines that did compile.
+bool dbi_update_string(DbiProgram prog, char *text);
+
+// Same as dbi_update_string, but `text` replaces the whole program: lines that are not in it are
+// deleted.
+bool dbi_reload_string(DbiProgram prog, char *text);
+
+// Lines whose text is unchanged keep their compiled code when a program is compiled, updated or
+// reloaded again. Gets how many lines the last of those calls reused and how many it compiled.
+void dbi_get_compile_stats(DbiProgram prog, long *reused, long *compiled);
+
+// In lazy mode, compiling only checks each line's number and first command, and a line is fully
+// compiled the first time it runs. Other syntax errors are reported when the line runs instead.
+// Eager mode (the default) compiles and checks every line up front.
+void dbi_set_lazy_compile(DbiProgram prog, bool lazy);
+
+// Optimizes the whole program: GOTO's and GOSUB's to lines that only GOTO another line jump
+// straight to where they end up, GOSUB followed by RETURN becomes GOTO, small subroutines that are
+// only reached by GOSUB are copied into their callers and lines that can never run are dropped.
+// Line text is kept, so LIST and SAVE are unaffected, and errors are still reported on the line
+// they come from. Once any line is added, changed or removed, optimized lines are compiled from
+// their text again, and nothing is optimized until this is called again.
+// Returns false if a lazily compiled line has a syntax error.
+bool dbi_optimize(DbiProgram prog);
+
+// Saves compiled program as an image, which can later be loaded with dbi_compile_file without
+// re-parsing the source. Images are mapped into memory read-only and executed in place, so
+// processes loading the same image share its pages.
+// Loading fails if the program loading the image is missing any of the commands it uses.
+bool dbi_save_image(DbiProgram prog, char *file_name);
+
+// Enables on-disk caching of compiled files in `dir` (which must already exist), or disables it
+// if `dir` is NULL. dbi_compile_file will then store an image of each file it compiles, keyed by
+// a hash of the source, the registered commands and the image format version, and load that
+// image instead of compiling the same source again.
+// Cache entries are written atomically, so a cache directory can be shared between processes.
+void dbi_set_compile_cache(DbiProgram prog, char *dir);
+void dbi_get_cache_stats(DbiProgram prog, long *hits, long *misses);
+
 DbiProgram dbi_program_new(void);
 void dbi_program_free(DbiProgram prog);
 
+// Registries let many programs use the same commands without registering them in each program.
+// dbi_registry_new creates a registry from the commands registered in `prog`, after which no more
+// commands can be registered in `prog`. Programs created with dbi_program_new_with_registry start
+// with those commands and can't register others. A registry can't be changed, so it can be used
+// by programs on any thread. It is only freed once it and every program using it have been
+// freed, so dbi_registry_free can be called as soon as no more programs need to be created.
+DbiRegistry dbi_registry_new(DbiProgram prog);
+DbiProgram dbi_program_new_with_registry(DbiRegistry registry);
+void dbi_registry_free(DbiRegistry registry);
+
 // Executes program in runtime
 //
 // If program finishes with DBI_STATUS_YIELD, calling dbi_run again will
@@ -91,17 +219,92 @@ void dbi_program_free(DbiProgram prog);
 // (but retaining any local variables that were set)
 enum DbiStatus dbi_run(DbiRuntime dbi, DbiProgram prog);
 
+// Same as dbi_run, but stops once `timeout_us` microseconds of wall-clock time have passed.
+//
+// The clock is only read at safepoints (GOTO / GOSUB / RETURN / NEXT and foreign calls), and at
+// most once every DBI_DEADLINE_POLL_INTERVAL iterations, so the program may run slightly past its
+// deadline.
+// On timeout, DBI_STATUS_TIMEOUT is returned and the error message is set. Like DBI_STATUS_YIELD,
+// calling dbi_run / dbi_run_with_deadline again resumes from the line where execution stopped.
+enum DbiStatus dbi_run_with_deadline(DbiRuntime dbi, DbiProgram prog, long timeout_us);
+
 DbiRuntime dbi_runtime_new(void);
 void dbi_runtime_free(DbiRuntime dbi);
 
+// Creates a copy of a runtime (variables, arrays, GOSUB and FOR stacks, resume position and
+// context), e.g. to run several branches of a yielded program independently. Variables and arrays
+// are shared between the copies until one of them writes to them. A fork of a runtime that is
+// sleeping on timers is added to the same timers. The fork must be freed with dbi_runtime_free.
+DbiRuntime dbi_runtime_fork(DbiRuntime dbi);
+
+// Writes a compact binary snapshot of a runtime (variables, arrays, GOSUB and FOR stacks, resume
+// position) into buf, e.g. so a yielded program can be resumed in a different process.
+// Returns the size of the snapshot. If this is larger than `size`, the snapshot was not fully
+// written and should be retried with a larger buffer.
+size_t dbi_runtime_save(DbiRuntime dbi, DbiProgram prog, void *buf, size_t size);
+
+// Loads snapshot created by dbi_runtime_save into runtime. Fails if the snapshot is invalid or was
+// taken while running a different program.
+bool dbi_runtime_restore(DbiRuntime dbi, DbiProgram prog, const void *buf, size_t size);
+
+// Suspends runtime for `ms` milliseconds, and should be returned from the command calling it, e.g.
+// `return dbi_runtime_sleep(dbi, 1000);`. If the runtime has timers (see dbi_set_timers), this
+// returns DBI_STATUS_WAITING, and dbi_run returns DBI_STATUS_WAITING until the time has passed,
+// after which the program resumes just after the command. Otherwise, the calling thread sleeps
+// and DBI_STATUS_GOOD is returned.
+enum DbiStatus dbi_runtime_sleep(DbiRuntime dbi, long ms);
+
+// Timers let a thread serve many sleeping runtimes: runtimes that sleep are added to a timer wheel
+// and returned by dbi_timers_advance once they wake up. Timers are not thread safe, so a thread
+// serving runtimes should have its own.
+DbiTimers dbi_timers_new(void);
+void dbi_timers_free(DbiTimers timers);
+
+// Runtime sleeps on `timers` from now on. Must not be called while the runtime is sleeping.
+void dbi_set_timers(DbiRuntime dbi, DbiTimers timers);
+
+// Gets milliseconds until dbi_timers_advance should next be called (0 if a runtime has already
+// woken up), or -1 if no runtime is sleeping. Can be passed straight to poll() as its timeout.
+// A runtime may not have woken up yet when the timeout ends, in which case it is just called again.
+long dbi_timers_timeout(DbiTimers timers);
+
+// Advances timers to the current time, and stores up to `size` runtimes that have woken up in
+// `ready`, which can then be run with dbi_run. Returns the number of runtimes stored. If this is
+// `size`, there may be more.
+int dbi_timers_advance(DbiTimers timers, DbiRuntime *ready, int size);
+
 // Writes an error message in the dbi runtime
 // Should only be used for returning an error message from a foreign function
 void dbi_runtime_error(DbiRuntime dbi, const char *fmt, ...);
 
 // Get compilation / runtime errors as a string
 // Error will be set after dbi_run is called
+// Errors are kept per thread, so this returns the last error from a call made on the same thread
 char *dbi_strerror(void);
 
+// By default INPUT reads a line from stdin. If `suspend` is set, INPUT instead makes dbi_run return
+// DBI_STATUS_INPUT, unless input has been provided with dbi_provide_input. Calling dbi_run after
+// providing input resumes the program at the INPUT, which then reads the provided input. This lets
+// one thread serve many interactive programs without blocking on any of them. When built with
+// DBI_DISABLE_IO, INPUT cannot read stdin, so runtimes suspend by default and INPUT is an error if
+// suspending is turned off and no input has been provided.
+void dbi_set_suspend_on_input(DbiRuntime dbi, bool suspend);
+
+// Provides one line of input, in the same format as typed on stdin (e.g. `1, "two", x + 3`), for
+// the next INPUT to read. `buf` is copied and does not need to be NUL-terminated. Replaces any
+// input that has been provided but not read yet.
+void dbi_provide_input(DbiRuntime dbi, const char *buf, size_t len);
+
+// Output written by commands (e.g. PRINT) is buffered in the runtime, and only written out when
+// the buffer is full, when dbi_run returns, before INPUT or sleeping, or when it is flushed
+// explicitly. It is written to stdout, unless an output function is set with dbi_set_output, in
+// which case `write` is called with `ctx` and each chunk of output. Commands that print in other
+// ways should call dbi_flush first, so that output stays in order.
+void dbi_set_output(DbiRuntime dbi, DbiOutput write, void *ctx);
+void dbi_write(DbiRuntime dbi, const char *buf, size_t len);
+void dbi_write_int(DbiRuntime dbi, long num);
+void dbi_flush(DbiRuntime dbi);
+
 // Context can be used to pass data between C and dbi in foreign calls
 void dbi_set_context(DbiRuntime dbi, void *context);
 void *dbi_get_context(DbiRuntime dbi);
@@ -110,16 +313,29 @@ void *dbi_get_context(DbiRuntime dbi);
 int dbi_get_argc(DbiRuntime dbi);
 struct DbiObject **dbi_get_argv(DbiRuntime dbi);
 
+// Get line number that a suspended (yielded / timed out) runtime will resume from
+long dbi_get_lineno(DbiRuntime dbi);
+
 // Get object associated with var (which can be any letter a - z)
 struct DbiObject *dbi_get_var(DbiRuntime dbi, char var);
 void dbi_set_var(DbiRuntime dbi, char var, struct DbiObject *obj);
 
+// Get elements of array `var` (created with DIM var(n)) and set `size` to its number of elements,
+// or return NULL if the array has not been dimensioned. Elements are stored contiguously and can
+// be read or written in place. The pointer is valid until the array is dimensioned again, the
+// runtime is forked or restored, or the runtime is freed.
+long *dbi_get_array(DbiRuntime dbi, char var, long *size);
+
+// Create array `var` with `size` zeroed elements (like DIM var(size - 1)), replacing any existing
+// array, and return its elements to be filled in.
+long *dbi_dim_array(DbiRuntime dbi, char var, long size);
+
 // If you just want to interactively run a BASIC script, use this (passing NULL for the file name
 // just drops you into repl)
 bool dbi_repl(DbiProgram prog, char *input_file_name);
 bool dbi_repl_with_context(DbiProgram prog, char *input_file_name, void *context);
 
-// Get text of line at given number
+// Get text of line at given number. The string is only valid until the next call.
 char *dbi_get_line(DbiProgram prog, long lineno);
 
 // Print out human readable bytecode of program
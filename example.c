@@ -4,6 +4,19 @@
  * 2. A more complex example using function arguments and error handling
  * 3. A function that accepts multiple arguments of different types
  * 4. Example of passing control back and forth between C and DBI
+ * 5. Running a program with a time limit
+ * 6. Measuring how fast a large generated program compiles
+ * 7. Updating a program while a runtime is partway through running it
+ * 8. Comparing a FOR loop with the same loop written with IF and GOTO
+ * 9. Sharing arrays between C and DBI without copying
+ * 10. Measuring deeply recursive GOSUB's
+ * 11. Measuring how fast a program compiles with many registered commands
+ * 12. Sharing registered commands between many short-lived programs
+ * 13. Running several programs that wait on slow commands from one thread
+ * 14. Serving many sleeping programs from one thread
+ * 15. Feeding INPUT to many interactive programs from one thread
+ * 16. Measuring how fast INPUT reads values
+ * 17. Sending output somewhere other than stdout, and measuring output throughput
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +24,8 @@
 #include <dbi.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#include <poll.h>
 
 #define ignore(thing) (void)thing
 
@@ -57,16 +72,15 @@ char *sleep_program_good =
     "04 end\n";
 
 char *sleep_program_compile_err = "01 sleepffi 1, 2, 3\n";
-char *sleep_program_runtime_err = "01 sleepffi \"this should be a runtime error\"\n";
+char *sleep_program_type_err = "01 sleepffi \"this should be a compile error\"\n";
+char *sleep_program_runtime_err = "01 let s = \"this should be a runtime error\" : sleepffi s\n";
 
-enum DbiStatus sleep_ffi(DbiRuntime dbi)
+// The signature "I" means the argument has already been checked to be an integer
+enum DbiStatus sleep_ffi(DbiRuntime dbi, int argc, union DbiValue *args)
 {
-    struct DbiObject **argv = dbi_get_argv(dbi);
-    if (argv[0]->type != DBI_INT) {
-        dbi_runtime_error(dbi, "expected numeric value in SLEEPFFI but got a string");
-        return DBI_STATUS_ERROR;
-    }
-    sleep(argv[0]->bint);
+    ignore(dbi);
+    ignore(argc);
+    sleep(args[0].bint);
     return DBI_STATUS_GOOD;
 }
 
@@ -75,13 +89,14 @@ void example_sleep(void)
     char *programs[] = {
         sleep_program_good,
         sleep_program_compile_err,
+        sleep_program_type_err,
         sleep_program_runtime_err
     };
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < 4; i++) {
         char *program = programs[i];
 
         DbiProgram prog = dbi_program_new();
-        dbi_register_command(prog, "SLEEPFFI", sleep_ffi, 1);
+        dbi_register_typed_command(prog, "SLEEPFFI", sleep_ffi, "I");
 
         bool ret = dbi_compile_string(prog, program);
         if (!ret) {
@@ -211,12 +226,694 @@ void example_echo(void)
     dbi_program_free(prog);
 }
 
+// *******************************************************************
+// **************************** Deadlines **************************** 
+// *******************************************************************
+char *spin_program =
+    "01 let i = 0\n"
+    "02 let i = i + 1 : if i < 50000 then goto 02\n"
+    "03 end\n";
+
+void example_deadline(void)
+{
+    DbiProgram prog = dbi_program_new();
+
+    bool ret = dbi_compile_string(prog, spin_program);
+    assert(ret);
+
+    DbiRuntime dbi = dbi_runtime_new();
+
+    // Give the program 1ms at a time, doing other work in between
+    enum DbiStatus status;
+    int slices = 0;
+    while ((status = dbi_run_with_deadline(dbi, prog, 1000)) == DBI_STATUS_TIMEOUT) {
+        printf("timed out, will resume at line %ld\n", dbi_get_lineno(dbi));
+        slices++;
+    }
+    assert(status == DBI_STATUS_FINISHED);
+    printf("i = %ld after %d time slices\n", dbi_get_var(dbi, 'i')->bint, slices + 1);
+
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************ Compile Throughput *********************** 
+// *******************************************************************
+#define THROUGHPUT_LINES 1000000
+
+void example_compile_throughput(void)
+{
+    // Generated programs often rewrite the same lines, so line numbers wrap around
+    size_t size = (size_t) THROUGHPUT_LINES * 80;
+    char *text = malloc(size);
+    size_t len = 0;
+    for (long i = 0; i < THROUGHPUT_LINES; i++) {
+        len += snprintf(text + len, size - len,
+                "%ld let a = a + %ld * (b - 3) : if a > %ld then print \"line\", a\n",
+                i % (DBI_MAX_PROG_SIZE - 1) + 1, i % 1000, i % 777);
+    }
+
+    DbiProgram prog = dbi_program_new();
+    dbi_register_command(prog, "PRINT", slow_print_ffi, -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ret = dbi_compile_string(prog, text);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(ret);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("compiled %d lines (%.1f MB) in %.3fs: %.1f MB/s, %.2f million lines/s\n",
+            THROUGHPUT_LINES, len / 1e6, seconds, len / 1e6 / seconds,
+            THROUGHPUT_LINES / 1e6 / seconds);
+
+    dbi_program_free(prog);
+    free(text);
+}
+
+// *******************************************************************
+// ************************** Hot Swapping *************************** 
+// *******************************************************************
+char *rules_program =
+    "10 let r = 1\n"
+    "20 pause\n"
+    "30 let s = r\n"
+    "40 end\n";
+
+enum DbiStatus pause_ffi(DbiRuntime dbi)
+{
+    ignore(dbi);
+    return DBI_STATUS_YIELD;
+}
+
+void example_hot_swap(void)
+{
+    DbiProgram prog = dbi_program_new();
+    dbi_register_command(prog, "PAUSE", pause_ffi, 0);
+    bool ret = dbi_compile_string(prog, rules_program);
+    assert(ret);
+
+    DbiRuntime old_dbi = dbi_runtime_new();
+    enum DbiStatus status = dbi_run(old_dbi, prog);
+    assert(status == DBI_STATUS_YIELD);
+
+    // Both lines change at once. The suspended runtime finishes on the lines it started with,
+    // which could just as well be running on another thread.
+    ret = dbi_update_string(prog, "10 let r = 2\n30 let s = r * 10\n");
+    assert(ret);
+
+    DbiRuntime new_dbi = dbi_runtime_new();
+    while (dbi_run(new_dbi, prog) == DBI_STATUS_YIELD);
+    status = dbi_run(old_dbi, prog);
+    assert(status == DBI_STATUS_FINISHED);
+    printf("old run: s = %ld, new run: s = %ld\n", dbi_get_var(old_dbi, 's')->bint,
+            dbi_get_var(new_dbi, 's')->bint);
+
+    dbi_runtime_free(old_dbi);
+    dbi_runtime_free(new_dbi);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ********************* Updating Optimized Code ********************* 
+// *******************************************************************
+char *optimized_program =
+    "10 let a = 0\n"
+    "20 gosub 100\n"
+    "30 gosub 50\n"
+    "40 end\n"
+    "50 goto 60\n"
+    "60 return\n"
+    "70 let a = a * 2 : return\n"
+    "100 let a = a + 1 : return\n";
+
+void example_update_optimized(void)
+{
+    DbiProgram prog = dbi_program_new();
+    bool ret = dbi_compile_string(prog, optimized_program);
+    assert(ret);
+    ret = dbi_optimize(prog);
+    assert(ret);
+
+    // Line 100 is inlined into line 20 and line 30 jumps straight to 60, so both have to be
+    // compiled again once the lines they were built from change
+    ret = dbi_update_string(prog, "50 goto 70\n100 let a = a + 50 : return\n");
+    assert(ret);
+
+    DbiRuntime dbi = dbi_runtime_new();
+    enum DbiStatus status = dbi_run(dbi, prog);
+    assert(status == DBI_STATUS_FINISHED);
+    printf("a = %ld (expected 100)\n", dbi_get_var(dbi, 'a')->bint);
+    assert(dbi_get_var(dbi, 'a')->bint == 100);
+
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************* Loop Benchmark ************************** 
+// *******************************************************************
+#define LOOP_RUNS 100
+
+char *for_loop_program =
+    "01 let s = 0\n"
+    "02 for i = 1 to 50000\n"
+    "03 let s = s + i\n"
+    "04 next i\n"
+    "05 end\n";
+
+char *goto_loop_program =
+    "01 let s = 0 : let i = 1\n"
+    "02 let s = s + i\n"
+    "03 let i = i + 1 : if i <= 50000 then goto 02\n"
+    "04 end\n";
+
+static double time_loop(char *text)
+{
+    DbiProgram prog = dbi_program_new();
+    bool ret = dbi_compile_string(prog, text);
+    assert(ret);
+    DbiRuntime dbi = dbi_runtime_new();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOOP_RUNS; i++) {
+        enum DbiStatus status = dbi_run(dbi, prog);
+        assert(status == DBI_STATUS_FINISHED);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void example_loop_benchmark(void)
+{
+    double for_seconds = time_loop(for_loop_program);
+    double goto_seconds = time_loop(goto_loop_program);
+    printf("FOR/NEXT: %.1f ns per iteration, IF/GOTO: %.1f ns per iteration\n",
+            for_seconds * 1e9 / (LOOP_RUNS * 50000.0), goto_seconds * 1e9 / (LOOP_RUNS * 50000.0));
+}
+
+// *******************************************************************
+// ***************************** Arrays ****************************** 
+// *******************************************************************
+char *histogram_program =
+    "10 dim h(9)\n"
+    "20 for i = 0 to n - 1\n"
+    "30 let b = d(i) / 10\n"
+    "40 let h(b) = h(b) + 1\n"
+    "50 next i\n"
+    "60 end\n";
+
+void example_arrays(void)
+{
+    DbiProgram prog = dbi_program_new();
+    bool ret = dbi_compile_string(prog, histogram_program);
+    assert(ret);
+    DbiRuntime dbi = dbi_runtime_new();
+
+    // Input is written straight into the program's array
+    long count = 1000;
+    long *data = dbi_dim_array(dbi, 'd', count);
+    for (long i = 0; i < count; i++) {
+        data[i] = rand() % 100;
+    }
+    dbi_get_var(dbi, 'n')->bint = count;
+
+    enum DbiStatus status = dbi_run(dbi, prog);
+    assert(status == DBI_STATUS_FINISHED);
+
+    long size;
+    long *histogram = dbi_get_array(dbi, 'h', &size);
+    for (long i = 0; i < size; i++) {
+        printf("%2ld-%2ld: %ld\n", i * 10, i * 10 + 9, histogram[i]);
+    }
+
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************* Recursive GOSUB ************************* 
+// *******************************************************************
+#define RECURSION_DEPTH 20000
+
+// Statements after a GOSUB run once it returns, so the sum is added up on the way back out
+char *recursion_program =
+    "10 let s = 0 : gosub 100\n"
+    "20 end\n"
+    "100 if n = 0 then return\n"
+    "110 let n = n - 1 : gosub 100 : let s = s + 1 : return\n";
+
+void example_recursion(void)
+{
+    DbiProgram prog = dbi_program_new();
+    bool ret = dbi_compile_string(prog, recursion_program);
+    assert(ret);
+    DbiRuntime dbi = dbi_runtime_new();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOOP_RUNS; i++) {
+        dbi_get_var(dbi, 'n')->bint = RECURSION_DEPTH;
+        enum DbiStatus status = dbi_run(dbi, prog);
+        assert(status == DBI_STATUS_FINISHED);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("s = %ld, %.1f ns per GOSUB / RETURN at depth up to %d\n",
+            dbi_get_var(dbi, 's')->bint, seconds * 1e9 / (LOOP_RUNS * (RECURSION_DEPTH + 1.0)),
+            RECURSION_DEPTH);
+
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************* Command Lookup ************************** 
+// *******************************************************************
+#define LOOKUP_COMMANDS 1000
+#define LOOKUP_LINES 200000
+
+enum DbiStatus nop_ffi(DbiRuntime dbi)
+{
+    ignore(dbi);
+    return DBI_STATUS_GOOD;
+}
+
+void example_command_lookup(void)
+{
+    // Names are HOSTAAA, HOSTAAB, ..., since command names can only have letters
+    static char names[LOOKUP_COMMANDS][8];
+    DbiProgram prog = dbi_program_new();
+    for (int i = 0; i < LOOKUP_COMMANDS; i++) {
+        snprintf(names[i], sizeof(names[i]), "HOST%c%c%c",
+                'A' + i / (26 * 26), 'A' + i / 26 % 26, 'A' + i % 26);
+        dbi_register_command(prog, names[i], nop_ffi, 0);
+    }
+
+    size_t size = (size_t) LOOKUP_LINES * 40;
+    char *text = malloc(size);
+    size_t len = 0;
+    for (long i = 0; i < LOOKUP_LINES; i++) {
+        len += snprintf(text + len, size - len, "%ld %s : %s\n", i % (DBI_MAX_PROG_SIZE - 1) + 1,
+                names[i * 7 % LOOKUP_COMMANDS], names[i * 13 % LOOKUP_COMMANDS]);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ret = dbi_compile_string(prog, text);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(ret);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("compiled %d lines calling %d registered commands in %.3fs: %.0f ns per command\n",
+            LOOKUP_LINES, LOOKUP_COMMANDS, seconds, seconds * 1e9 / (2.0 * LOOKUP_LINES));
+
+    dbi_program_free(prog);
+    free(text);
+}
+
+// *******************************************************************
+// ************************* Shared Registry ************************* 
+// *******************************************************************
+#define REGISTRY_COMMANDS 300
+#define REGISTRY_PROGRAMS 10000
+
+char *short_lived_program =
+    "10 hostaaa\n"
+    "20 hostalm\n"
+    "30 end\n";
+
+static void register_host_commands(DbiProgram prog, char names[][8])
+{
+    for (int i = 0; i < REGISTRY_COMMANDS; i++) {
+        dbi_register_command(prog, names[i], nop_ffi, 0);
+    }
+}
+
+static double time_programs(DbiRegistry registry, char names[][8])
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < REGISTRY_PROGRAMS; i++) {
+        DbiProgram prog;
+        if (registry) {
+            prog = dbi_program_new_with_registry(registry);
+        } else {
+            prog = dbi_program_new();
+            register_host_commands(prog, names);
+        }
+        bool ret = dbi_compile_string(prog, short_lived_program);
+        assert(ret);
+        DbiRuntime dbi = dbi_runtime_new();
+        enum DbiStatus status = dbi_run(dbi, prog);
+        assert(status == DBI_STATUS_FINISHED);
+        dbi_runtime_free(dbi);
+        dbi_program_free(prog);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void example_shared_registry(void)
+{
+    static char names[REGISTRY_COMMANDS][8];
+    for (int i = 0; i < REGISTRY_COMMANDS; i++) {
+        snprintf(names[i], sizeof(names[i]), "HOST%c%c%c",
+                'A' + i / (26 * 26), 'A' + i / 26 % 26, 'A' + i % 26);
+    }
+
+    // Commands are registered once, in a program that is only used to build the registry
+    DbiProgram builder = dbi_program_new();
+    register_host_commands(builder, names);
+    DbiRegistry registry = dbi_registry_new(builder);
+    dbi_program_free(builder);
+
+    double separate_seconds = time_programs(0, names);
+    double shared_seconds = time_programs(registry, names);
+    dbi_registry_free(registry);
+    printf("%d commands registered per program: %.1f us per program, shared: %.1f us per program\n",
+            REGISTRY_COMMANDS, separate_seconds * 1e6 / REGISTRY_PROGRAMS,
+            shared_seconds * 1e6 / REGISTRY_PROGRAMS);
+}
+
+// *******************************************************************
+// ************************** Async Commands ************************* 
+// *******************************************************************
+#define ASYNC_RUNTIMES 4
+
+// Each program sleeps for 300ms in total
+char *async_program =
+    "10 for i = 1 to 3\n"
+    "20 fetch \"item\", 100\n"
+    "30 next i\n"
+    "40 end\n";
+
+// Runs on a worker thread, so it only gets the runtime's context
+enum DbiStatus fetch_ffi(void *context, int argc, union DbiValue *args)
+{
+    ignore(argc);
+    usleep(args[1].bint * 1000);
+    (*(long *) context)++;
+    return DBI_STATUS_GOOD;
+}
+
+void example_async(void)
+{
+    DbiProgram prog = dbi_program_new();
+    dbi_register_async_command(prog, "FETCH", fetch_ffi, "SI");
+    bool ret = dbi_compile_string(prog, async_program);
+    assert(ret);
+
+    DbiRuntime runtimes[ASYNC_RUNTIMES];
+    long fetched[ASYNC_RUNTIMES] = {0};
+    for (int i = 0; i < ASYNC_RUNTIMES; i++) {
+        runtimes[i] = dbi_runtime_new();
+        dbi_set_context(runtimes[i], &fetched[i]);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd pfd = { .fd = dbi_async_fd(), .events = POLLIN };
+    int running = ASYNC_RUNTIMES;
+    bool finished[ASYNC_RUNTIMES] = {0};
+    while (running > 0) {
+        for (int i = 0; i < ASYNC_RUNTIMES; i++) {
+            if (!finished[i] && dbi_run(runtimes[i], prog) != DBI_STATUS_WAITING) {
+                finished[i] = true;
+                running--;
+            }
+        }
+        if (running > 0) {
+            // Sleep until one of the commands has finished
+            poll(&pfd, 1, -1);
+            char buf[64];
+            while (read(pfd.fd, buf, sizeof(buf)) > 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long total = 0;
+    for (int i = 0; i < ASYNC_RUNTIMES; i++) {
+        total += fetched[i];
+        dbi_runtime_free(runtimes[i]);
+    }
+    printf("%d programs fetched %ld items from one thread in %.0fms\n", ASYNC_RUNTIMES, total,
+            seconds * 1000);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************* Sleeping Programs *********************** 
+// *******************************************************************
+#define SLEEPING_RUNTIMES 100000
+
+// Each program naps three times, for up to half a second each time
+char *napping_program =
+    "10 let n = n + 1\n"
+    "20 nap t\n"
+    "30 if n < 3 then goto 10\n"
+    "40 end\n";
+
+enum DbiStatus nap_ffi(DbiRuntime dbi, int argc, union DbiValue *args)
+{
+    ignore(argc);
+    return dbi_runtime_sleep(dbi, args[0].bint);
+}
+
+void example_sleeping_programs(void)
+{
+    DbiProgram prog = dbi_program_new();
+    dbi_register_typed_command(prog, "NAP", nap_ffi, "I");
+    bool ret = dbi_compile_string(prog, napping_program);
+    assert(ret);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DbiTimers timers = dbi_timers_new();
+    DbiRuntime *runtimes = malloc(SLEEPING_RUNTIMES * sizeof(*runtimes));
+    for (int i = 0; i < SLEEPING_RUNTIMES; i++) {
+        runtimes[i] = dbi_runtime_new();
+        dbi_set_timers(runtimes[i], timers);
+        struct DbiObject nap = { .type = DBI_INT, .bint = 1 + rand() % 500 };
+        dbi_set_var(runtimes[i], 't', &nap);
+        enum DbiStatus status = dbi_run(runtimes[i], prog);
+        assert(status == DBI_STATUS_WAITING);
+    }
+
+    int finished = 0;
+    DbiRuntime ready[256];
+    while (finished < SLEEPING_RUNTIMES) {
+        // Sleep until the next program wakes up
+        poll(NULL, 0, dbi_timers_timeout(timers));
+        int count;
+        do {
+            count = dbi_timers_advance(timers, ready, 256);
+            for (int i = 0; i < count; i++) {
+                enum DbiStatus status = dbi_run(ready[i], prog);
+                assert(status == DBI_STATUS_WAITING || status == DBI_STATUS_FINISHED);
+                finished += status == DBI_STATUS_FINISHED;
+            }
+        } while (count == 256);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d programs napped 3 times each on one thread in %.0fms\n", SLEEPING_RUNTIMES,
+            seconds * 1000);
+    for (int i = 0; i < SLEEPING_RUNTIMES; i++) {
+        dbi_runtime_free(runtimes[i]);
+    }
+    free(runtimes);
+    dbi_timers_free(timers);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// *********************** Interactive Sessions ********************** 
+// *******************************************************************
+#define SESSIONS 1000
+
+// Adds up numbers until it is given 0
+char *adder_program =
+    "10 input n\n"
+    "20 if n = 0 then goto 50\n"
+    "30 let s = s + n\n"
+    "40 goto 10\n"
+    "50 end\n";
+
+void example_interactive_sessions(void)
+{
+    DbiProgram prog = dbi_program_new();
+    bool ret = dbi_compile_string(prog, adder_program);
+    assert(ret);
+
+    DbiRuntime sessions[SESSIONS];
+    for (int i = 0; i < SESSIONS; i++) {
+        sessions[i] = dbi_runtime_new();
+        dbi_set_suspend_on_input(sessions[i], true);
+        enum DbiStatus status = dbi_run(sessions[i], prog);
+        assert(status == DBI_STATUS_INPUT);
+    }
+
+    // Every session is sent 1, 2, ..., 10 and then 0, as if typed in by its user
+    for (int n = 10; n >= 0; n--) {
+        for (int i = 0; i < SESSIONS; i++) {
+            char line[16];
+            int len = snprintf(line, sizeof(line), "%d\n", n == 0 ? 0 : 11 - n);
+            dbi_provide_input(sessions[i], line, len);
+            enum DbiStatus status = dbi_run(sessions[i], prog);
+            assert(status == (n == 0 ? DBI_STATUS_FINISHED : DBI_STATUS_INPUT));
+        }
+    }
+
+    long total = 0;
+    for (int i = 0; i < SESSIONS; i++) {
+        total += dbi_get_var(sessions[i], 's')->bint;
+        dbi_runtime_free(sessions[i]);
+    }
+    printf("%d sessions added up to %ld\n", SESSIONS, total);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************* Input Throughput ************************ 
+// *******************************************************************
+#define INPUT_LINES 1000000
+
+char *summing_program =
+    "10 input a, b, c, d\n"
+    "20 let s = s + a + b + c + d\n"
+    "30 goto 10\n";
+
+void example_input_throughput(void)
+{
+    DbiProgram prog = dbi_program_new();
+    bool ret = dbi_compile_string(prog, summing_program);
+    assert(ret);
+    DbiRuntime dbi = dbi_runtime_new();
+    dbi_set_suspend_on_input(dbi, true);
+
+    // Lines are generated up front, so only reading them is measured
+    char (*lines)[48] = malloc(INPUT_LINES * sizeof(*lines));
+    int *lens = malloc(INPUT_LINES * sizeof(*lens));
+    for (long i = 0; i < INPUT_LINES; i++) {
+        lens[i] = snprintf(lines[i], sizeof(lines[i]), "%ld, %ld, %ld, %ld\n",
+                i, i % 1000, 12345678 - i, -i);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    enum DbiStatus status = dbi_run(dbi, prog);
+    for (long i = 0; i < INPUT_LINES; i++) {
+        assert(status == DBI_STATUS_INPUT);
+        dbi_provide_input(dbi, lines[i], lens[i]);
+        status = dbi_run(dbi, prog);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("s = %ld, read %.1f million values/s\n", dbi_get_var(dbi, 's')->bint,
+            4 * INPUT_LINES / 1e6 / seconds);
+
+    free(lines);
+    free(lens);
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+}
+
+// *******************************************************************
+// ************************* Output Throughput *********************** 
+// *******************************************************************
+#define OUTPUT_RUNS 50
+
+char *report_program =
+    "10 for i = 1 to 20000\n"
+    "20 show \"item \", i, \": \", i * 37\n"
+    "30 next i\n"
+    "40 end\n";
+
+// Like PRINT, but writes to the runtime's output
+enum DbiStatus show_ffi(DbiRuntime dbi)
+{
+    int argc = dbi_get_argc(dbi);
+    struct DbiObject **argv = dbi_get_argv(dbi);
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]->type == DBI_INT) {
+            dbi_write_int(dbi, argv[i]->bint);
+        } else {
+            dbi_write(dbi, argv[i]->bstr, strlen(argv[i]->bstr));
+        }
+    }
+    dbi_write(dbi, "\n", 1);
+    return DBI_STATUS_GOOD;
+}
+
+struct OutputStats {
+    size_t bytes;
+    long writes;
+};
+
+void count_output(void *ctx, const char *buf, size_t len)
+{
+    ignore(buf);
+    struct OutputStats *stats = ctx;
+    stats->bytes += len;
+    stats->writes++;
+}
+
+void example_output_throughput(void)
+{
+    DbiProgram prog = dbi_program_new();
+    dbi_register_borrowing_command(prog, "SHOW", show_ffi, -1);
+    bool ret = dbi_compile_string(prog, report_program);
+    assert(ret);
+    DbiRuntime dbi = dbi_runtime_new();
+    struct OutputStats stats = {0};
+    dbi_set_output(dbi, count_output, &stats);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < OUTPUT_RUNS; i++) {
+        enum DbiStatus status = dbi_run(dbi, prog);
+        assert(status == DBI_STATUS_FINISHED);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("wrote %.1f MB in %ld writes: %.1f MB/s, %.1f million lines/s\n", stats.bytes / 1e6,
+            stats.writes, stats.bytes / 1e6 / seconds, OUTPUT_RUNS * 20000 / 1e6 / seconds);
+
+    dbi_runtime_free(dbi);
+    dbi_program_free(prog);
+}
+
 int main(int argc, char *argv[])
 {
     // example_echo();
     example_slow_print();
     // example_sleep();
     // example_hello_world();
+    // example_deadline();
+    // example_compile_throughput();
+    // example_hot_swap();
+    // example_update_optimized();
+    // example_loop_benchmark();
+    // example_arrays();
+    // example_recursion();
+    // example_command_lookup();
+    // example_shared_registry();
+    // example_async();
+    // example_sleeping_programs();
+    // example_interactive_sessions();
+    // example_input_throughput();
+    // example_output_throughput();
     return 0;
 }
 
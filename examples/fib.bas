@@ -1,71 +1,17 @@
 010 print "Enter a number" : input n
-020 let x = 0 : rem fib(n - 2)
-030 let y = 1 : rem fib(n - 1)
-040 let r = 1 : rem fib(n) (return value)
-050 if n = 0 then let r = 0
-060 if n = 0 then goto 150
-070 if n = 1 then goto 150
-075 if n > 46 then goto 170
-080 let i = 0
-090 let i = i + 1 : rem Top of loop
-100 if n = i then goto 150
-110 let r = x + y
-120 let x = y
-130 let y = r
-140 goto 90
-150 print "fib(", n, ") = ", r
-160 return
+020 dim f(92) : let f(1) = 1 : rem fib(92) is the largest that fits in 64 bits
+030 for i = 2 to 92 : let f(i) = f(i - 1) + f(i - 2) : next i
+040 if n < 0 then goto 080
+050 if n > 92 then goto 170
+060 print "fib(", n, ") = ", f(n)
+070 return
+080 print "Fibonacci numbers start at n=0, there is no fib(", n, ")"
+090 return
 170 if n < 500 then goto 2000 + n
-180 print "You and I both know that I can't calculate past n=46, you're just being cruel now"
+180 print "You and I both know that I can't calculate past n=92, you're just being cruel now"
 190 return
 
-2000 REM don't let the user know that we can only do 32 bit ints
-2047 print "fib(47)=2971215073" : return
-2048 print "fib(48)=4807526976" : return
-2049 print "fib(49)=7778742049" : return
-2050 print "fib(50)=12586269025" : return
-2051 print "fib(51)=20365011074" : return
-2052 print "fib(52)=32951280099" : return
-2053 print "fib(53)=53316291173" : return
-2054 print "fib(54)=86267571272" : return
-2055 print "fib(55)=139583862445" : return
-2056 print "fib(56)=225851433717" : return
-2057 print "fib(57)=365435296162" : return
-2058 print "fib(58)=591286729879" : return
-2059 print "fib(59)=956722026041" : return
-2060 print "fib(60)=1548008755920" : return
-2061 print "fib(61)=2504730781961" : return
-2062 print "fib(62)=4052739537881" : return
-2063 print "fib(63)=6557470319842" : return
-2064 print "fib(64)=10610209857723" : return
-2065 print "fib(65)=17167680177565" : return
-2066 print "fib(66)=27777890035288" : return
-2067 print "fib(67)=44945570212853" : return
-2068 print "fib(68)=72723460248141" : return
-2069 print "fib(69)=117669030460994" : return
-2070 print "fib(70)=190392490709135" : return
-2071 print "fib(71)=308061521170129" : return
-2072 print "fib(72)=498454011879264" : return
-2073 print "fib(73)=806515533049393" : return
-2074 print "fib(74)=1304969544928657" : return
-2075 print "fib(75)=2111485077978050" : return
-2076 print "fib(76)=3416454622906707" : return
-2077 print "fib(77)=5527939700884757" : return
-2078 print "fib(78)=8944394323791464" : return
-2079 print "fib(79)=14472334024676221" : return
-2080 print "fib(80)=23416728348467685" : return
-2081 print "fib(81)=37889062373143906" : return
-2082 print "fib(82)=61305790721611591" : return
-2083 print "fib(83)=99194853094755497" : return
-2084 print "fib(84)=160500643816367088" : return
-2085 print "fib(85)=259695496911122585" : return
-2086 print "fib(86)=420196140727489673" : return
-2087 print "fib(87)=679891637638612258" : return
-2088 print "fib(88)=1100087778366101931" : return
-2089 print "fib(89)=1779979416004714189" : return
-2090 print "fib(90)=2880067194370816120" : return
-2091 print "fib(91)=4660046610375530309" : return
-2092 print "fib(92)=7540113804746346429" : return
+2000 REM don't let the user know that we can only do 64 bit ints
 2093 print "fib(93)=12200160415121876738" : return
 2094 print "fib(94)=19740274219868223167" : return
 2095 print "fib(95)=31940434634990099905" : return
@@ -579,21 +579,27 @@ char *bad_letter[] = { "         "
 
 int letter_map_size = sizeof(letter_map) / sizeof(*letter_map);
 
-static void print_big_lookup(char c, int line)
+static void print_big_row(DbiRuntime dbi, char *row)
+{
+    dbi_write(dbi, row, strlen(row));
+    dbi_write(dbi, " ", 1);
+}
+
+static void print_big_lookup(DbiRuntime dbi, char c, int line)
 {
     char cased = toupper(c);
     for (int i = 0; i < letter_map_size; i++) {
         if (cased == letter_map[i].letter) {
-            printf("%s ", letter_map[i].strings[line]);
+            print_big_row(dbi, letter_map[i].strings[line]);
             return;
         }
     }
-    printf("%s ", bad_letter[line]);
+    print_big_row(dbi, bad_letter[line]);
 }
 
-static void print_big(char *input)
+static void print_big(DbiRuntime dbi, char *input)
 {
-    printf("\n");
+    dbi_write(dbi, "\n", 1);
     char *init_input = input;
     int len = strlen(input);
 
@@ -601,11 +607,11 @@ static void print_big(char *input)
         for (int j = 0; j < WORD_HEIGHT; j++) {
             input = init_input;
             for (int k = i * WRAP_ON; input[k] != '\0' && k < (i + 1) * WRAP_ON; k++) {
-                print_big_lookup(input[k], j);
+                print_big_lookup(dbi, input[k], j);
             }
-            printf("\n");
+            dbi_write(dbi, "\n", 1);
         }
-        if (i + 1 <= len / WRAP_ON) printf("\n");
+        if (i + 1 <= len / WRAP_ON) dbi_write(dbi, "\n", 1);
     }
 }
 
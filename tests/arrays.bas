@@ -0,0 +1,10 @@
+010 dim a(10), b(2)
+020 for i = 0 to 10
+030 let a(i) = i * i
+040 next i
+050 let b(a(2) - 3) = a(10) + a(3 - 1)
+060 let s = 0
+070 for i = 0 to 10 : let s = s + a(i) : next
+080 if s + b(1) = 489 then print "ARRAYS test: passed"
+090 if s + b(1) <> 489 then print "ARRAYS test: failed"
+100 end
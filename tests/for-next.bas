@@ -0,0 +1,15 @@
+010 let s = 0
+020 for i = 1 to 10
+030 let s = s + i
+040 next i
+050 for i = 10 to 1 step -3
+060 let s = s + i
+070 next
+080 for i = 1 to 3
+090 for j = i to 3
+100 let s = s + 100
+110 next j
+120 next i
+130 if s = 677 then print "FOR-NEXT test: passed"
+140 if s <> 677 then print "FOR-NEXT test: failed"
+150 end
@@ -0,0 +1,8 @@
+010 let s = "hello" : let n = 0 - 7
+020 let x = len(s) + abs(n) * 10
+030 let y = abs(len("ab") - abs(n))
+040 dim a(3) : let a(abs(0 - 2)) = len(s)
+050 for i = 1 to len("abc") : let y = y + i : next i
+060 if x + y * 100 + a(2) * 10000 = 51175 then print "FUNCTIONS test: passed"
+070 if x + y * 100 + a(2) * 10000 <> 51175 then print "FUNCTIONS test: failed"
+080 end
@@ -1,9 +1,12 @@
 010 let x = 321
-020 gosub 100
-030 if x = 123 then print "GOSUB-RETURN test: passed"
-040 if x <> 123 then print "GOSUB-RETURN test: failed"
-050 end
+020 gosub 100 : let x = x + 1
+030 let n = 100 : let d = 0 : gosub 200
+040 if x * 1000 + d = 124100 then print "GOSUB-RETURN test: passed"
+050 if x * 1000 + d <> 124100 then print "GOSUB-RETURN test: failed"
+060 end
 
 100 let x = 123
 110 return
 
+200 if n = 0 then return
+210 let n = n - 1 : gosub 200 : let d = d + 1 : return
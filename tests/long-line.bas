@@ -0,0 +1,4 @@
+010 let x = 101 + 202 + 303 + 404 + 505 + 606 + 707 + 808 + 909 + 1010 : rem lines compiled from files are not limited to DBI_MAX_LINE_LENGTH lines compiled from files are not limited to DBI_MAX_LINE_LENGTH lines compiled from files are not limited to DBI_MAX_LINE_LENGTH lines compiled from files are not limited to DBI_MAX_LINE_LENGTH lines compiled from files are not limited to DBI_MAX_LINE_LENGTH 
+020 if x = 5555 then goto 40
+030 print "long line test: failed" : end
+040 print "long line test: passed" : end
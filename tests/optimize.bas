@@ -0,0 +1,19 @@
+010 let s = 0 : let t = 0
+020 goto 500
+030 for i = 1 to 10
+040 gosub 700 : if s > 50 then let t = t + 1
+050 next i
+060 let n = 5 : gosub 300
+070 if s * 1000 + t * 100 + n = 55100 then print "OPTIMIZE test: passed"
+080 if s * 1000 + t * 100 + n <> 55100 then print "OPTIMIZE test: failed"
+090 end
+100 print "OPTIMIZE test: failed"
+
+300 if n = 0 then return
+310 let n = n - 1 : gosub 300 : return
+
+500 goto 510
+510 goto 520
+520 goto 030
+
+700 let s = s + i : return
@@ -3,11 +3,22 @@
 030 system "echo '1 + 2, 3 * 4, 5 - 6' | valgrind ./dbi 'tests/input.bas'"
 040 system "valgrind ./dbi 'tests/let.bas'"
 050 system "valgrind ./dbi 'tests/gosub-return.bas'"
+060 system "valgrind ./dbi -o expr.dbc 'tests/expr.bas' && valgrind ./dbi -e expr.dbc ; rm -f expr.dbc"
+070 system "valgrind ./dbi -e 'tests/long-line.bas'"
+080 system "valgrind ./dbi 'tests/for-next.bas'"
+090 system "valgrind ./dbi 'tests/arrays.bas'"
+100 system "valgrind ./dbi -O 'tests/optimize.bas'"
+105 system "valgrind ./dbi -e 'tests/optimize.bas'"
 
 110 system "valgrind ./dbi -c 'tests/expr.bas' && echo 'passed'"
 120 system "valgrind ./dbi -c 'tests/relop.bas' && echo 'passed'"
 130 rem system "echo '1 + 2, 3 * 4, 5 - 6' | valgrind ./dbi 'tests/input.bas'"
 140 system "valgrind ./dbi -c 'tests/let.bas' && echo 'passed'"
 150 system "valgrind ./dbi -c 'tests/gosub-return.bas' && echo 'passed'"
+160 system "valgrind ./dbi -c 'tests/for-next.bas' && echo 'passed'"
+170 system "valgrind ./dbi -c 'tests/arrays.bas' && echo 'passed'"
+180 system "valgrind ./dbi -c 'tests/optimize.bas' && echo 'passed'"
+190 system "valgrind ./dbi 'tests/functions.bas'"
+200 system "valgrind ./dbi -c 'tests/functions.bas' && echo 'passed'"
 
 999 end